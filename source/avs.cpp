@@ -1,9 +1,36 @@
 #include "avs.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <list>
 #include <string>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <utility>
+#include <vector>
+#include <stdexcept>
+#include <thread>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 static constexpr std::pair<const char *, int> processingModes[] =
 {
@@ -37,19 +64,1153 @@ static constexpr std::pair<const char *, int> curveFileExtensions[] =
     {".csv", FILETYPE_CSV},
     {".crv", FILETYPE_CRV},
     {".map", FILETYPE_MAP},
+    {".grdc", FILETYPE_GRDC},
+};
+
+enum { RANGE_FULL, RANGE_LIMITED };
+
+static constexpr std::pair<const char *, int> sampleRanges[] =
+{
+    {"full", RANGE_FULL},
+    {"limited", RANGE_LIMITED},
+};
+
+enum { PRECISION_INTEGER, PRECISION_FLOAT, PRECISION_DOUBLE };
+
+static constexpr std::pair<const char *, int> precisions[] =
+{
+    {"float", PRECISION_FLOAT},
+    {"double", PRECISION_DOUBLE},
+};
+
+enum { STATS_NONE, STATS_INPUT, STATS_OUTPUT, STATS_BOTH };
+
+static constexpr std::pair<const char *, int> statsModes[] =
+{
+    {"none", STATS_NONE},
+    {"input", STATS_INPUT},
+    {"output", STATS_OUTPUT},
+    {"both", STATS_BOTH},
+};
+
+enum { MATRIX_AUTO = -1, MATRIX_BT709 = 1, MATRIX_BT470BG = 5, MATRIX_BT601 = 6, MATRIX_BT2020 = 9 };
+
+static constexpr std::pair<const char *, int> yuvMatrices[] =
+{
+    {"auto", MATRIX_AUTO},
+    {"601", MATRIX_BT601},
+    {"709", MATRIX_BT709},
+    {"2020", MATRIX_BT2020},
+};
+
+enum { AUTOCURVE_NONE = -1 };
+
+static constexpr std::pair<const char *, int> autoCurveMethods[] =
+{
+    {"none", AUTOCURVE_NONE},
+    {"levels", AUTOCURVE_LEVELS},
+    {"stretch", AUTOCURVE_STRETCH},
+    {"equalize", AUTOCURVE_EQUALIZE},
+};
+
+// Private cache hint answered with the id of a GradationFilter instance, which
+// allows finding it from a clip even when AviSynth+ has wrapped it in a cache.
+enum { CACHE_GET_GRADATION_INSTANCE = 0x47524400 };
+
+static bool isPerChannelRgb(ProcessingMode process)
+{
+    return process == PROCMODE_RGB || process == PROCMODE_FULL;
+}
+
+// Points of each channel, as passed to ImportPoints.
+struct PointSet
+{
+    uint8_t points[5][maxPoints][2];
+    size_t count[5]; // Zero for channels which keep the identity curve.
+
+    PointSet()
+        { memset(this, 0, sizeof(*this)); } // Unused points are zero, so that sets can be compared bytewise.
+};
+
+// Error found in curves provided by the user, without the filter name.
+class CurveError : public std::runtime_error
+{
+public:
+
+    using std::runtime_error::runtime_error;
+};
+
+static std::string format(const char *fmt, ...)
+{
+    char buffer[512];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    return buffer;
+}
+
+// Integer or nested array parsed from text with the syntax of AviSynth arrays,
+// such as "[[0, 0], [128, 140], [255, 255]]". It has the parts of the AVSValue
+// interface used by readPoints.
+class TextValue
+{
+    bool isArray;
+    int value;
+    std::vector<TextValue> elems;
+
+    static void skipSpace(const char *&p)
+    {
+        while (isspace((unsigned char) *p))
+            ++p;
+    }
+
+    static TextValue parseValue(const char *&p)
+    {
+        TextValue result {};
+        skipSpace(p);
+        if (*p == '[')
+        {
+            result.isArray = true;
+            ++p;
+            skipSpace(p);
+            if (*p != ']')
+                for (;;)
+                {
+                    result.elems.push_back(parseValue(p));
+                    skipSpace(p);
+                    if (*p == ']')
+                        break;
+                    if (*p != ',')
+                        throw CurveError(format("Expected ',' or ']' at '%.16s'", p));
+                    ++p;
+                }
+            ++p;
+            return result;
+        }
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v < INT_MIN || INT_MAX < v)
+            throw CurveError(format("Expected an integer or '[' at '%.16s'", p));
+        result.value = int(v);
+        p = end;
+        return result;
+    }
+
+public:
+
+    // Parses the whole of 'text'. Throws CurveError.
+    static TextValue parse(const char *text)
+    {
+        const char *p = text;
+        TextValue result = parseValue(p);
+        skipSpace(p);
+        if (*p)
+            throw CurveError(format("Unexpected text at '%.16s'", p));
+        return result;
+    }
+
+    bool IsArray() const
+        { return isArray; }
+    bool IsInt() const
+        { return !isArray; }
+    int ArraySize() const
+        { return int(elems.size()); }
+    int AsInt() const
+        { return value; }
+    const TextValue &operator[](int i) const
+        { return elems[i]; }
+};
+
+template <class Value>
+static PointSet readPoints(ProcessingMode process, const Value &elems, const char *argName)
+// 'Value' is AVSValue or TextValue. Throws CurveError.
+{
+    PointSet set;
+    Space space = GetSpace(process);
+    int channelCount = GetChannelCount(space);
+    int firstChannel = GetFirstChannel(space);
+    if (!elems.IsArray())
+        throw CurveError(format("'%s' is not an array", argName));
+    if (elems.ArraySize() > channelCount)
+        throw CurveError(format("Too many lists of points (%d). Space '%s' only has %d channels", elems.ArraySize(), space_names[space], channelCount));
+    for (int l = 0; l < elems.ArraySize(); ++l)
+    {
+        auto &points = elems[l];
+        if (!points.IsArray())
+            throw CurveError(format("In list %d of '%s': Not an array", l, argName));
+        if (maxPoints < points.ArraySize() )
+            throw CurveError(format("In list %d of '%s': Can't have more than %d points", l, argName, maxPoints));
+        Channel ch = Channel(l + firstChannel);
+        auto &outPoints = set.points[ch];
+        int16_t pos[256] {0};
+        size_t count = 0;
+        for (int p = 0; p < points.ArraySize(); ++p, ++count)
+        {
+            auto &point = points[p];
+            if (!point.IsArray() || point.ArraySize() != 2 || !point[0].IsInt() || !point[1].IsInt())
+                throw CurveError(format("In point %d of list %d of '%s': Invalid point. Expected an array of two integers", p, l, argName));
+            int x = point[0].AsInt();
+            int y = point[1].AsInt();
+            if (x < 0 || 255 < x || y < 0 || 255 < y)
+                throw CurveError(format("In list %d of '%s': Out-of-range point (%d, %d)", l, argName, x, y));
+            if (pos[x])
+                throw CurveError(format("In list %d of '%s': Points (%d, %d) and (%d, %d) overlap", l, argName, x, pos[x] - 1, x, y));
+            pos[x] = y + 1;
+            outPoints[count][0] = (uint8_t) x;
+            outPoints[count][1] = (uint8_t) y;
+        }
+        set.count[ch] = count;
+    }
+    return set;
+}
+
+// Curves ready for processing. They are never modified once compiled, so they
+// can be shared between frames and threads.
+typedef std::shared_ptr<const Gradation> CompiledGradation;
+
+// Settings shared by all the curves of a filter instance, which turn a set of
+// points into compiled curves.
+struct CurveCompiler
+{
+    Gradation base; // Initialized, with the processing mode set.
+    DrawMode drawMode;
+    bool hasLevels;
+    Levels inputLevels, outputLevels;
+    bool bakeStrength;
+    double strength;
+
+    void import(Gradation &grd, const PointSet &set) const
+    {
+        for (int c = 0; c < 5; ++c)
+            ImportPoints(grd, Channel(c), set.points[c], set.count[c], drawMode);
+    }
+
+    // Applies the steps which follow importing the points.
+    void finish(Gradation &grd) const
+    {
+        if (hasLevels)
+            ApplyLevels(grd, inputLevels, outputLevels);
+        if (bakeStrength)
+            ApplyStrength(grd, strength);
+        PreCalcLut(grd);
+    }
+
+    CompiledGradation compile(const PointSet &set) const
+    {
+        auto &&grd = std::make_shared<Gradation>(base);
+        import(*grd, set);
+        finish(*grd);
+        return grd;
+    }
+
+    // Returns null if the file cannot be read.
+    CompiledGradation compileFile(const char *filename, CurveFileType type) const
+    {
+        auto &&grd = std::make_shared<Gradation>(base);
+        if (!ImportCurve(*grd, filename, type, drawMode))
+            return nullptr;
+        finish(*grd);
+        return grd;
+    }
+
+    // Like ImportCurve, but reads a copy of the file instead of mapping it, for
+    // files which may be truncated or rewritten while they are imported.
+    // Reading a mapped file past its new end would crash the process.
+    bool importFileCopy(Gradation &grd, const char *filename, CurveFileType type) const
+    {
+        std::ifstream in(filename, std::ios::binary);
+        std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        return in.is_open() && !in.bad() && ImportCurveFromMemory(grd, data.data(), data.size(), type, drawMode);
+    }
+
+    // Same as compileFile, with importFileCopy.
+    CompiledGradation compileFileCopy(const char *filename, CurveFileType type) const
+    {
+        auto &&grd = std::make_shared<Gradation>(base);
+        if (!importFileCopy(*grd, filename, type))
+            return nullptr;
+        finish(*grd);
+        return grd;
+    }
+};
+
+// Source of curves which may change from frame to frame.
+class CurveSource
+{
+public:
+
+    virtual ~CurveSource() = default;
+    // Returns null for frames which use the default curves of the filter.
+    // Throws CurveError.
+    virtual CompiledGradation get(int n, const PVideoFrame &src, IScriptEnvironment *env) = 0;
+};
+
+// Value interpolated linearly between keyframes.
+class Animated
+{
+    std::vector<std::pair<int, double>> keys; // Sorted by frame number.
+
+public:
+
+    Animated(double value = 1) :
+        keys {{0, value}}
+    {
+    }
+
+    Animated(std::vector<std::pair<int, double>> &&aKeys) :
+        keys(std::move(aKeys))
+    {
+    }
+
+    bool isConstant() const
+        { return keys.size() == 1; }
+
+    double at(int n) const
+    {
+        size_t i = 0;
+        while (i < keys.size() && keys[i].first <= n)
+            ++i;
+        if (i == 0)
+            return keys.front().second;
+        if (i == keys.size())
+            return keys.back().second;
+        auto &k0 = keys[i - 1], &k1 = keys[i];
+        return k0.second + (k1.second - k0.second)*(n - k0.first)/(k1.first - k0.first);
+    }
+};
+
+// RGB curve derived from the luma histograms of the frames around each frame.
+// The histogram of each frame is measured once and cached, so that the result
+// does not depend on the order in which frames are requested.
+class AutoCurve
+{
+    struct Histogram { double bins[256]; };
+
+    const AutoCurveMethod method;
+    const DrawMode drawMode;
+    const int radius;
+    const double percentile, limit;
+    const size_t cacheSize;
+    std::mutex cacheMutex;
+    std::unordered_map<int, Histogram> cache;
+    std::deque<int> cacheOrder; // Oldest first.
+
+    template <class Measure>
+    Histogram getHistogram(int n, Measure &measure)
+    {
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            auto it = cache.find(n);
+            if (it != cache.end())
+                return it->second;
+        }
+        Histogram hist {};
+        measure(n, hist.bins);
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        if (cache.emplace(n, hist).second)
+        {
+            cacheOrder.push_back(n);
+            if (cacheOrder.size() > cacheSize)
+                cache.erase(cacheOrder.front()),
+                cacheOrder.pop_front();
+        }
+        return hist;
+    }
+
+public:
+
+    AutoCurve(AutoCurveMethod aMethod, DrawMode aDrawMode, int aRadius, double aPercentile, double aLimit) :
+        method(aMethod),
+        drawMode(aDrawMode),
+        radius(aRadius),
+        percentile(aPercentile),
+        limit(aLimit),
+        cacheSize(std::max(64, 4*(2*aRadius + 1)))
+    {
+    }
+
+    // Replaces the RGB curve of 'grd' with the one for frame 'n' of 'frameCount'.
+    // 'measure(i, bins)' must add the luma histogram of frame 'i' to 'bins'.
+    template <class Measure>
+    void apply(Gradation &grd, int n, int frameCount, Measure &&measure)
+    {
+        double bins[256] {0};
+        for (int i = std::max(n - radius, 0); i <= std::min(n + radius, frameCount - 1); ++i)
+        {
+            Histogram hist = getHistogram(i, measure);
+            for (int j = 0; j < 256; ++j)
+                bins[j] += hist.bins[j];
+        }
+        uint8_t points[maxPoints][2];
+        size_t count = MakeAutoPoints(bins, method, percentile, limit, points);
+        ImportPoints(grd, CHANNEL_RGB, points, count, drawMode);
+    }
+};
+
+// Point sets given at keyframes and interpolated in between. The curves of each
+// distinct interpolated set are compiled once and kept in a small LRU cache, so
+// frames on a plateau, or on a ramp too slow to change the rounded points,
+// share their tables.
+class KeyframedCurves final : public CurveSource
+{
+    typedef std::pair<std::string, CompiledGradation> CacheEntry;
+    enum { cacheSize = 16 };
+
+    const CurveCompiler compiler;
+    const std::vector<std::pair<int, PointSet>> keys; // Sorted by frame number.
+    std::mutex cacheMutex;
+    std::list<CacheEntry> cache; // Most recently used first.
+    std::unordered_map<std::string, std::list<CacheEntry>::iterator> cacheIndex;
+
+    PointSet at(int n) const
+    {
+        size_t i = 0;
+        while (i < keys.size() && keys[i].first <= n)
+            ++i;
+        if (i == 0)
+            return keys.front().second;
+        if (i == keys.size())
+            return keys.back().second;
+        auto &k0 = keys[i - 1], &k1 = keys[i];
+        double t = double(n - k0.first)/(k1.first - k0.first);
+        PointSet set;
+        for (int c = 0; c < 5; ++c)
+            for (size_t p = 0; p < k0.second.count[c]; ++p)
+            {
+                auto &p0 = k0.second.points[c][p], &p1 = k1.second.points[c][p];
+                int x = (int) lround(p0[0] + t*(p1[0] - p0[0]));
+                int y = (int) lround(p0[1] + t*(p1[1] - p0[1]));
+                size_t &count = set.count[c];
+                if (count > 0 && set.points[c][count - 1][0] == x)
+                    continue; // Points which round to the same position are merged.
+                set.points[c][count][0] = uint8_t(x);
+                set.points[c][count][1] = uint8_t(y);
+                ++count;
+            }
+        return set;
+    }
+
+public:
+
+    KeyframedCurves(const CurveCompiler &aCompiler, std::vector<std::pair<int, PointSet>> &&aKeys) :
+        compiler(aCompiler),
+        keys(std::move(aKeys))
+    {
+    }
+
+    CompiledGradation get(int n, const PVideoFrame &, IScriptEnvironment *) override
+    {
+        PointSet set = at(n);
+        std::string key(reinterpret_cast<const char *>(&set), sizeof(set));
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            auto it = cacheIndex.find(key);
+            if (it != cacheIndex.end())
+            {
+                cache.splice(cache.begin(), cache, it->second);
+                return it->second->second;
+            }
+        }
+        CompiledGradation grd = compiler.compile(set);
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        if (cacheIndex.find(key) == cacheIndex.end())
+        {
+            cache.emplace_front(key, grd);
+            cacheIndex[key] = cache.begin();
+            if (cache.size() > cacheSize)
+                cacheIndex.erase(cache.back().first),
+                cache.pop_back();
+        }
+        return grd;
+    }
+};
+
+// Curves selected by frame ranges, as listed in a scene index file.
+class SceneCurves final : public CurveSource
+{
+public:
+
+    struct Scene
+    {
+        int first, last;
+        CompiledGradation grd; // Shared between scenes with the same curves.
+    };
+
+private:
+
+    const std::vector<Scene> scenes; // Sorted and non-overlapping.
+
+public:
+
+    SceneCurves(std::vector<Scene> &&aScenes) :
+        scenes(std::move(aScenes))
+    {
+    }
+
+    CompiledGradation get(int n, const PVideoFrame &, IScriptEnvironment *) override
+    {
+        auto it = std::upper_bound( scenes.begin(), scenes.end(), n,
+                                    [] (int n, const Scene &scene) { return n < scene.first; } );
+        if (it == scenes.begin() || n > (--it)->last)
+            return nullptr;
+        return it->grd;
+    }
+};
+
+// Points read at runtime for each frame, from a frame property or a script
+// variable. The curves are only compiled again when the points change; they
+// are published as an immutable snapshot which is replaced atomically, so
+// that concurrent frames always see complete tables.
+class RuntimeCurves final : public CurveSource
+{
+    struct Snapshot
+    {
+        size_t hash;
+        PointSet set;
+        CompiledGradation grd;
+    };
+
+    const CurveCompiler compiler;
+    const std::string propName, varName; // Empty if unused.
+    std::shared_ptr<const Snapshot> last;
+
+    static size_t hashPoints(const PointSet &set)
+    {
+        return std::hash<std::string>()(std::string(reinterpret_cast<const char *>(&set), sizeof(set)));
+    }
+
+    // Returns false if neither the property nor the variable is set.
+    bool readPointsAt(PointSet &set, const PVideoFrame &src, IScriptEnvironment *env) const
+    {
+        ProcessingMode process = compiler.base.process;
+        if (!propName.empty())
+        {
+            int err = 0;
+            const char *text = env->propGetData(env->getFramePropsRO(src), propName.c_str(), 0, &err);
+            if (!err)
+            {
+                set = readPoints(process, TextValue::parse(text), propName.c_str());
+                return true;
+            }
+        }
+        if (!varName.empty())
+        {
+            AVSValue value = env->GetVarDef(varName.c_str());
+            if (value.IsString())
+                set = readPoints(process, TextValue::parse(value.AsString()), varName.c_str());
+            else if (value.Defined())
+                set = readPoints(process, value, varName.c_str());
+            return value.Defined();
+        }
+        return false;
+    }
+
+public:
+
+    RuntimeCurves(const CurveCompiler &aCompiler, const char *aPropName, const char *aVarName) :
+        compiler(aCompiler),
+        propName(aPropName),
+        varName(aVarName)
+    {
+    }
+
+    CompiledGradation get(int, const PVideoFrame &src, IScriptEnvironment *env) override
+    {
+        PointSet set;
+        if (!readPointsAt(set, src, env))
+            return nullptr;
+        size_t hash = hashPoints(set);
+        std::shared_ptr<const Snapshot> snapshot = std::atomic_load(&last);
+        if (snapshot && snapshot->hash == hash && memcmp(&snapshot->set, &set, sizeof(set)) == 0)
+            return snapshot->grd;
+        CompiledGradation grd = compiler.compile(set);
+        std::atomic_store(&last, std::shared_ptr<const Snapshot>(new Snapshot {hash, set, grd}));
+        return grd;
+    }
+};
+
+// Curves from a file which is imported again whenever it changes. A background
+// thread polls its modification time and size, so frames only load a pointer.
+// New curves replace the old ones atomically, and frames already being
+// processed keep the curves they started with.
+class WatchedCurves final : public CurveSource
+{
+    const CurveCompiler compiler;
+    const std::string filename;
+    const CurveFileType type;
+    const std::chrono::milliseconds interval;
+    CompiledGradation current; // Null until the file changes.
+    std::mutex stopMutex;
+    std::condition_variable stopCondition;
+    bool stopping;
+    std::thread poller;
+
+    // The modification time is in nanoseconds where available, so that two
+    // saves of the same size within a second are told apart.
+    bool getFileState(std::pair<int64_t, int64_t> &state) const
+    {
+        struct stat st;
+        if (stat(filename.c_str(), &st) != 0)
+            return false;
+#if defined(__APPLE__)
+        int64_t mtime = int64_t(st.st_mtimespec.tv_sec)*1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+        int64_t mtime = int64_t(st.st_mtime)*1000000000;
+#else
+        int64_t mtime = int64_t(st.st_mtim.tv_sec)*1000000000 + st.st_mtim.tv_nsec;
+#endif
+        state = {mtime, int64_t(st.st_size)};
+        return true;
+    }
+
+    void poll()
+    {
+        std::pair<int64_t, int64_t> lastState {}, state;
+        getFileState(lastState);
+        std::unique_lock<std::mutex> lock(stopMutex);
+        while (!stopCondition.wait_for(lock, interval, [this] { return stopping; }))
+        {
+            if (!getFileState(state) || state == lastState)
+                continue;
+            lock.unlock();
+            // If the file is being written, importing may fail; it is then
+            // retried on the next poll.
+            if (CompiledGradation grd = compiler.compileFileCopy(filename.c_str(), type))
+            {
+                std::atomic_store(&current, grd);
+                lastState = state;
+            }
+            lock.lock();
+        }
+    }
+
+public:
+
+    WatchedCurves(const CurveCompiler &aCompiler, const char *aFilename, CurveFileType aType, int intervalMs) :
+        compiler(aCompiler),
+        filename(aFilename),
+        type(aType),
+        interval(intervalMs),
+        stopping(false),
+        poller(&WatchedCurves::poll, this)
+    {
+    }
+
+    ~WatchedCurves()
+    {
+        {
+            std::lock_guard<std::mutex> lock(stopMutex);
+            stopping = true;
+        }
+        stopCondition.notify_one();
+        poller.join();
+    }
+
+    CompiledGradation get(int, const PVideoFrame &, IScriptEnvironment *) override
+    {
+        return std::atomic_load(&current);
+    }
+};
+
+#ifndef _WIN32
+// Curves replaced at any time through a local Unix-domain socket. Clients send
+// point sets in the syntax of the 'points' argument, one per line, and each
+// line is answered with "OK" or "ERROR <message>". Point sets are validated and
+// compiled on a background thread, one client at a time, and published
+// atomically like in WatchedCurves.
+class ControlledCurves final : public CurveSource
+{
+    enum { maxLineLength = 65536 };
+
+    const CurveCompiler compiler;
+    const std::string path;
+    CompiledGradation current; // Null until a point set is received.
+    int listenFd;
+    int stopPipe[2];
+    std::thread server;
+
+    // Returns false if the server must stop.
+    bool waitReadable(int fd) const
+    {
+        pollfd fds[2] {{fd, POLLIN, 0}, {stopPipe[0], POLLIN, 0}};
+        while (poll(fds, 2, -1) < 0)
+            if (errno != EINTR)
+                return false;
+        return !(fds[1].revents & POLLIN);
+    }
+
+    static bool sendAll(int fd, const std::string &data)
+    {
+#ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL;
+#else
+        const int flags = 0;
+#endif
+        for (size_t sent = 0; sent < data.size(); )
+        {
+            ssize_t size = send(fd, data.data() + sent, data.size() - sent, flags);
+            if (size < 0 && errno != EINTR)
+                return false;
+            sent += size > 0 ? size : 0;
+        }
+        return true;
+    }
+
+    std::string handleLine(const std::string &line)
+    {
+        try
+        {
+            PointSet set = readPoints(compiler.base.process, TextValue::parse(line.c_str()), "points");
+            std::atomic_store(&current, compiler.compile(set));
+            return "OK\n";
+        }
+        catch (const CurveError &e)
+        {
+            return std::string("ERROR ").append(e.what()).append("\n");
+        }
+    }
+
+    void serveClient(int fd)
+    {
+        std::string pending;
+        char buffer[4096];
+        while (waitReadable(fd))
+        {
+            ssize_t size = read(fd, buffer, sizeof(buffer));
+            if (size <= 0)
+                return;
+            pending.append(buffer, size);
+            size_t end;
+            while ((end = pending.find('\n')) != std::string::npos)
+            {
+                std::string reply = handleLine(pending.substr(0, end));
+                pending.erase(0, end + 1);
+                if (!sendAll(fd, reply))
+                    return;
+            }
+            if (pending.size() > maxLineLength)
+            {
+                sendAll(fd, "ERROR Line too long\n");
+                return;
+            }
+        }
+    }
+
+    void run()
+    {
+        while (waitReadable(listenFd))
+        {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0)
+                continue;
+            serveClient(fd);
+            close(fd);
+        }
+    }
+
+public:
+
+    ControlledCurves(const CurveCompiler &aCompiler, const char *aPath) :
+        compiler(aCompiler),
+        path(aPath),
+        listenFd(-1),
+        stopPipe {-1, -1}
+    {
+    }
+
+    ~ControlledCurves()
+    {
+        if (server.joinable())
+        {
+            while (write(stopPipe[1], "", 1) < 0 && errno == EINTR)
+                ;
+            server.join();
+        }
+        for (int fd : {listenFd, stopPipe[0], stopPipe[1]})
+            if (fd >= 0)
+                close(fd);
+        if (listenFd >= 0)
+            unlink(path.c_str());
+    }
+
+    // Creates the socket and starts serving. Returns an error message, or an
+    // empty string on success.
+    std::string start()
+    {
+        sockaddr_un addr {};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            return "Socket path is too long";
+        strcpy(addr.sun_path, path.c_str());
+        // A socket left behind by a previous instance is replaced, but any
+        // other kind of file is not.
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(path.c_str());
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return strerror(errno);
+        if (bind(fd, (const sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+        {
+            std::string error = strerror(errno);
+            close(fd);
+            return error;
+        }
+        listenFd = fd;
+        if (pipe(stopPipe) != 0)
+            return strerror(errno);
+        server = std::thread(&ControlledCurves::run, this);
+        return {};
+    }
+
+    CompiledGradation get(int, const PVideoFrame &, IScriptEnvironment *) override
+    {
+        return std::atomic_load(&current);
+    }
+};
+#endif
+
+// Tables which the row kernels derive from a set of curves, so that they are
+// built once per set rather than for every frame.
+struct PreparedCurves
+{
+    std::unique_ptr<const CurveSamples> samples; // Null unless the pipeline uses them.
+    std::unique_ptr<const LinearCurves> linear; // Null unless in the RGB or RGB + R/G/B mode.
+
+    PreparedCurves(const Gradation &grd, const FramePipeline &pipeline, int bpc)
+    {
+        if (pipeline.process == processRowSamples || pipeline.process == processRowWeightedSamples<false>
+            || pipeline.process == processRowWeightedSamples<true>)
+            samples.reset(new CurveSamples(grd, bpc));
+        if (grd.process == PROCMODE_RGB || grd.process == PROCMODE_FULL)
+            linear.reset(new LinearCurves(grd));
+    }
+};
+
+// Prepared tables of the curves returned by a CurveSource, in a small LRU cache
+// keyed on the compiled set. Each entry keeps its set alive, so that its
+// address is not reused by another one.
+class PreparedCurvesCache
+{
+    typedef std::pair<CompiledGradation, std::shared_ptr<const PreparedCurves>> CacheEntry;
+    enum { cacheSize = 16 };
+
+    const FramePipeline pipeline;
+    const int bpc;
+    std::mutex cacheMutex;
+    std::list<CacheEntry> cache; // Most recently used first.
+    std::unordered_map<const Gradation *, std::list<CacheEntry>::iterator> cacheIndex;
+
+public:
+
+    PreparedCurvesCache(const FramePipeline &aPipeline, int aBpc) :
+        pipeline(aPipeline),
+        bpc(aBpc)
+    {
+    }
+
+    std::shared_ptr<const PreparedCurves> get(const CompiledGradation &grd)
+    {
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            auto it = cacheIndex.find(grd.get());
+            if (it != cacheIndex.end())
+            {
+                cache.splice(cache.begin(), cache, it->second);
+                return it->second->second;
+            }
+        }
+        auto &&prepared = std::make_shared<const PreparedCurves>(*grd, pipeline, bpc);
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        if (cacheIndex.find(grd.get()) == cacheIndex.end())
+        {
+            cache.emplace_front(grd, prepared);
+            cacheIndex[grd.get()] = cache.begin();
+            if (cache.size() > cacheSize)
+                cacheIndex.erase(cache.back().first.get()),
+                cache.pop_back();
+        }
+        return prepared;
+    }
+};
+
+// PixelCaches kept between frames, so that the colours of a frame are still
+// cached for the next one. A frame takes a cache for the whole time it is
+// processed, so threads never share one, and one filled with other curves is
+// cleared first. Null curves are never equal to those of another frame.
+class PixelCachePool
+{
+public:
+
+    typedef std::pair<CompiledGradation, std::unique_ptr<PixelCache>> Entry;
+
+private:
+
+    std::mutex poolMutex;
+    std::vector<Entry> pool;
+
+public:
+
+    // Cache for 'curves', with its counts reset for a new frame.
+    Entry take(const CompiledGradation &curves)
+    {
+        Entry entry;
+        {
+            std::lock_guard<std::mutex> lock(poolMutex);
+            if (!pool.empty())
+            {
+                auto it = std::find_if(pool.begin(), pool.end(), [&] (const Entry &e) { return curves && e.first == curves; });
+                if (it != pool.end())
+                    std::swap(*it, pool.back());
+                entry = std::move(pool.back());
+                pool.pop_back();
+            }
+        }
+        if (!entry.second)
+            entry.second.reset(new PixelCache);
+        else if (!curves || entry.first != curves)
+            entry.second->clear();
+        entry.first = curves;
+        entry.second->pixels = entry.second->hits = entry.second->runs = 0;
+        return entry;
+    }
+
+    void give(Entry &&entry)
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        pool.push_back(std::move(entry));
+    }
+};
+
+// Reuse of the output of unchanged tiles between consecutive frames. The input
+// of each frame is hashed in tiles of tileSize x tileSize pixels, and compared
+// with the hashes of the previous frame if it was the latest one processed with
+// the same curves, strength and YUV matrix. Tiles with the same hash are copied from the
+// previous output instead of being processed. Only the latest frame is kept, so
+// memory use is bounded by one output frame and its hashes.
+class TileDedup
+{
+public:
+
+    enum { tileSize = 64 };
+
+    // Tiles of a frame being processed, in the memory order of the source.
+    struct Frame
+    {
+        std::vector<uint64_t> hashes;
+        std::vector<bool> dirty;
+        PVideoFrame previous; // Output of the previous frame, or null if every tile is dirty.
+    };
+
+    TileDedup(const VideoInfo &srcVi, const VideoInfo &dstVi) :
+        srcFormat(srcVi), dstFormat(dstVi), width(srcVi.width), height(srcVi.height),
+        columns((srcVi.width + tileSize - 1)/tileSize), rows((srcVi.height + tileSize - 1)/tileSize)
+    {
+    }
+
+    void begin(int n, const PVideoFrame &src, const CompiledGradation &curves, double strength, const YuvMatrix &matrix, Frame &frame)
+    {
+        hashTiles(src, frame.hashes);
+        frame.dirty.assign(frame.hashes.size(), true);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if ( latest.n != n - 1 || latest.curves != curves || latest.strength != strength ||
+                 latest.matrix.kr != matrix.kr || latest.matrix.kb != matrix.kb || latest.matrix.fullRange != matrix.fullRange )
+                return;
+            frame.previous = latest.output;
+            for (size_t i = 0; i < frame.hashes.size(); ++i)
+                frame.dirty[i] = frame.hashes[i] != latest.hashes[i];
+        }
+    }
+
+    RowBands bands(const Frame &frame) const
+    // The columns from the first to the last dirty tile of each row of tiles.
+    {
+        RowBands bands {tileSize, std::vector<std::pair<int, int>>(rows, {0, 0})};
+        for (int ty = 0; ty < rows; ++ty)
+        {
+            int first = columns, last = -1;
+            for (int tx = 0; tx < columns; ++tx)
+                if (frame.dirty[ty*columns + tx])
+                {
+                    first = std::min(first, tx);
+                    last = tx;
+                }
+            if (first <= last)
+                bands.ranges[ty] = {first*tileSize, std::min((last + 1)*tileSize, width)};
+        }
+        return bands;
+    }
+
+    template <class F>
+    void forEachDirtyTile(const Frame &frame, F &&f) const
+    // Calls f(x, y, width, height) for each dirty tile.
+    {
+        for (int ty = 0; ty < rows; ++ty)
+            for (int tx = 0; tx < columns; ++tx)
+                if (frame.dirty[ty*columns + tx])
+                    f(tx*tileSize, ty*tileSize, std::min<int>(tileSize, width - tx*tileSize), std::min<int>(tileSize, height - ty*tileSize));
+    }
+
+    void finish(int n, const CompiledGradation &curves, double strength, const YuvMatrix &matrix, Frame &frame, PVideoFrame &dst)
+    // Copies the clean tiles into 'dst', and makes it the latest frame.
+    {
+        if (frame.previous)
+            copyCleanTiles(frame, dst);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (n > latest.n)
+        {
+            latest.n = n;
+            latest.curves = curves;
+            latest.strength = strength;
+            latest.matrix = matrix;
+            latest.hashes.swap(frame.hashes);
+            latest.output = dst;
+        }
+    }
+
+private:
+
+    struct Latest
+    {
+        int n = -1;
+        CompiledGradation curves; // Kept alive, so that their address is not reused.
+        double strength = 1;
+        YuvMatrix matrix {}; // Of YUV input, which _Matrix and _ColorRange may change per frame.
+        std::vector<uint64_t> hashes;
+        PVideoFrame output;
+    };
+
+    const FrameFormat srcFormat, dstFormat;
+    const int width, height, columns, rows;
+    std::mutex mutex;
+    Latest latest;
+
+    template <class F>
+    static void forEachPlane(const FrameFormat &format, F &&f)
+    // Calls f(plane, bytes per pixel) for each plane of the format.
+    {
+        if (format.isPacked())
+            f(0, format.step*sampleSize(format));
+        else
+            for (int c = 0; c < format.componentCount(); ++c)
+                f(getPlane(format, c), sampleSize(format));
+    }
+
+    static uint64_t hashBytes(uint64_t h, const BYTE *p, int size)
+    // Every step is a bijection of 'h', so tiles differing in a single word
+    // always have different hashes.
+    {
+        int i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t v;
+            memcpy(&v, p + i, 8);
+            h = (h ^ v)*0x9E3779B97F4A7C15ULL;
+            h ^= h >> 32;
+        }
+        for (; i < size; ++i)
+            h = (h ^ p[i])*0x100000001B3ULL;
+        return h;
+    }
+
+    void hashTiles(const PVideoFrame &src, std::vector<uint64_t> &hashes) const
+    {
+        hashes.assign(size_t(rows)*columns, 0xCBF29CE484222325ULL);
+        forEachPlane(srcFormat, [&] (int plane, int pixelSize) {
+            const BYTE *p = src->GetReadPtr(plane);
+            int pitch = src->GetPitch(plane);
+            for (int y = 0; y < height; ++y, p += pitch)
+                for (int tx = 0; tx < columns; ++tx)
+                {
+                    uint64_t &h = hashes[(y/tileSize)*columns + tx];
+                    h = hashBytes(h, p + tx*tileSize*pixelSize, std::min<int>(tileSize, width - tx*tileSize)*pixelSize);
+                }
+        });
+    }
+
+    void copyCleanTiles(const Frame &frame, PVideoFrame &dst) const
+    {
+        // Packed RGB is stored bottom-up, so rows are flipped between packed and planar formats.
+        bool flip = srcFormat.isPacked() != dstFormat.isPacked();
+        forEachPlane(dstFormat, [&] (int plane, int pixelSize) {
+            const BYTE *prevp = frame.previous->GetReadPtr(plane);
+            BYTE *dstp = dst->GetWritePtr(plane);
+            int prevPitch = frame.previous->GetPitch(plane), dstPitch = dst->GetPitch(plane);
+            for (int y = 0; y < height; ++y)
+            {
+                int row = flip ? height - 1 - y : y;
+                for (int tx = 0; tx < columns; ++tx)
+                    if (!frame.dirty[(y/tileSize)*columns + tx])
+                        memcpy(dstp + row*dstPitch + tx*tileSize*pixelSize, prevp + row*prevPitch + tx*tileSize*pixelSize,
+                               std::min<int>(tileSize, width - tx*tileSize)*pixelSize);
+            }
+        });
+    }
 };
 
 class GradationFilter final : public GenericVideoFilter
 {
+    static std::mutex instancesMutex;
+    static std::unordered_map<int, const GradationFilter *> instances;
+    static int lastInstanceId;
+
+    int instanceId;
     const std::unique_ptr<const Gradation> grd;
-    FrameProcesser &processFrame;
+    const FramePipeline pipeline; // Unused if 'pipeline.process' is null.
+    const int precision;
+    const int matrix;
+    const bool dither;
+    const Animated strength; // Only the part which is not in the curves already.
+    const PClip mask;
+    MaskReader * const readMask;
+    const int stats;
+    const std::unique_ptr<AutoCurve> autoCurve;
+    const std::unique_ptr<CurveSource> curveSource; // If null, 'grd' is used for every frame.
+    std::unique_ptr<const PreparedCurves> prepared; // Of 'grd', if the pipeline is used.
+    std::unique_ptr<PreparedCurvesCache> preparedCache; // Of the curves of 'curveSource', if the pipeline is used.
+    std::unique_ptr<PixelCachePool> pixelCaches; // Null unless results are cached.
+    std::unique_ptr<TileDedup> dedup; // Null unless unchanged tiles are reused.
 
     GradationFilter( PClip &aChild, std::unique_ptr<Gradation> &aGrd,
-                     FrameProcesser &aProcessFrame) :
+                     const FramePipeline &aPipeline, int aPrecision, int aMatrix,
+                     int outPixelType, bool aDither, Animated &&aStrength,
+                     const PClip &aMask, MaskReader *aReadMask, int aStats,
+                     std::unique_ptr<AutoCurve> &aAutoCurve,
+                     std::unique_ptr<CurveSource> &aCurveSource, bool aCache, bool aDedup ) :
         GenericVideoFilter(std::move(aChild)),
         grd(std::move(aGrd)),
-        processFrame(aProcessFrame)
+        pipeline(aPipeline),
+        precision(aPrecision),
+        matrix(aMatrix),
+        dither(aDither),
+        strength(std::move(aStrength)),
+        mask(aMask),
+        readMask(aReadMask),
+        stats(aStats),
+        autoCurve(std::move(aAutoCurve)),
+        curveSource(std::move(aCurveSource))
+    {
+        vi.pixel_type = outPixelType;
+        if (aCache)
+            pixelCaches.reset(new PixelCachePool);
+        if (aDedup)
+            dedup.reset(new TileDedup(child->GetVideoInfo(), vi));
+        int bpc = child->GetVideoInfo().BitsPerComponent();
+        if (pipeline.process)
+            prepared.reset(new PreparedCurves(*grd, pipeline, bpc));
+        if (pipeline.process && curveSource)
+            preparedCache.reset(new PreparedCurvesCache(pipeline, bpc));
+        std::lock_guard<std::mutex> lock(instancesMutex);
+        instanceId = ++lastInstanceId;
+        instances[instanceId] = this;
+    }
+
+    ~GradationFilter()
     {
+        std::lock_guard<std::mutex> lock(instancesMutex);
+        instances.erase(instanceId);
     }
 
     int __stdcall SetCacheHints(int cachehints, int frame_range) override;
@@ -60,17 +1221,35 @@ class GradationFilter final : public GenericVideoFilter
     static T parseEnum(const char *, const char *, const std::pair<const char *, int>(&)[N], IScriptEnvironment *);
 
     static CurveFileType parseCurveFileType(const char *, const char *, const char *, IScriptEnvironment *);
-    static void parsePoints(Gradation &, DrawMode, const AVSValue &, const char *Name, IScriptEnvironment *);
+    static PointSet parsePoints(ProcessingMode, const AVSValue &, const char *argName, IScriptEnvironment *);
+    static std::vector<std::pair<int, PointSet>> parseKeyframes(ProcessingMode, const AVSValue &, IScriptEnvironment *);
+    static std::vector<SceneCurves::Scene> parseScenes(const char *filename, const CurveCompiler &, IScriptEnvironment *);
+    static Animated parseStrength(const AVSValue &, IScriptEnvironment *);
+    static Levels parseLevels(const AVSValue &, const AVSValue &range, const char *argName, const char *rangeArgName, IScriptEnvironment *);
 
-    template <GradationProcesser &process>
-    static FrameProcesser &getFrameProcesser(const VideoInfo &vi, IScriptEnvironment *env);
+    static MaskReader *getMaskReader(const VideoInfo &vi, const VideoInfo &maskVi, IScriptEnvironment *env);
+    static RowReader *getRowReader(const VideoInfo &vi, IScriptEnvironment *env);
+    static RowWriter *getRowWriter(const VideoInfo &vi, IScriptEnvironment *env);
+    static int getOutputPixelType(const VideoInfo &vi, int bits, IScriptEnvironment *env);
+    YuvMatrix getYuvMatrix(const PVideoFrame &src, IScriptEnvironment *env) const;
+    static void setStatsProps(PVideoFrame &dst, const char *prefix, const ChannelStats (&stats)[3], IScriptEnvironment *env);
+    static void setCacheProps(PVideoFrame &dst, const PixelCache &cache, IScriptEnvironment *env);
 
-    enum { iChild, iProcess, iCurveType, iPoints, iFile, iFileType, iPrecise };
+    static const GradationFilter *findInstance(const PClip &clip);
+    bool canBeFused(int precision, int matrix) const;
+    bool blendsInKernel() const
+        { return !strength.isConstant() || strength.at(0) != 1 || mask; }
+
+    enum { iChild, iProcess, iCurveType, iPoints, iFile, iFileType, iPrecise, iMatrix, iOutputBits, iDither,
+           iInputRange, iOutputRange, iInputLevels, iOutputLevels, iStrength, iMask, iStats,
+           iAuto, iAutoRadius, iAutoPercentile, iAutoLimit, iKeyframes, iScenes, iPointsProp, iPointsVar, iWatch, iWatchInterval, iControl, iExportFile, iCache, iDedup };
 
     static const char *Name()
         { return "Gradation"; }
     static const char *Signature()
-        { return "c[process]s[curve_type]s[points].[file]s[file_type]s[precise]b"; }
+        { return "c[process]s[curve_type]s[points].[file]s[file_type]s[precise].[matrix]s[output_bits]i[dither]b"
+                 "[input_range]s[output_range]s[input_levels].[output_levels].[strength].[mask]c[stats]s"
+                 "[auto]s[auto_radius]i[auto_percentile]f[auto_limit]f[keyframes].[scenes]s[points_prop]s[points_var]s[watch]b[watch_interval]i[control]s[export_file]s[cache]b[dedup]b"; }
     static AVSValue __cdecl Create(AVSValue args, void *, IScriptEnvironment *env);
 
 public:
@@ -88,6 +1267,7 @@ int __stdcall GradationFilter::SetCacheHints(int cachehints, int)
     switch (cachehints)
     {
         case CACHE_GET_MTMODE: return MT_NICE_FILTER;
+        case CACHE_GET_GRADATION_INSTANCE: return instanceId;
         default: return 0;
     }
 }
@@ -95,12 +1275,195 @@ int __stdcall GradationFilter::SetCacheHints(int cachehints, int)
 PVideoFrame __stdcall GradationFilter::GetFrame(int n, IScriptEnvironment* env)
 {
     auto &&src = child->GetFrame(n, env);
-    auto &&dst = src->IsWritable() ? (const PVideoFrame &) src
-                                   : (const PVideoFrame &) env->NewVideoFrameP(vi, &src);
-    processFrame(*grd, vi.width, vi.height, vi.pixel_type, src, dst);
+    auto &srcVi = child->GetVideoInfo();
+    PVideoFrame dst = src->IsWritable() && srcVi.pixel_type == vi.pixel_type
+                      ? src : env->NewVideoFrameP(vi, &src);
+    CompiledGradation frameCurves;
+    try
+    {
+        if (curveSource)
+            frameCurves = curveSource->get(n, src, env);
+    }
+    catch (const CurveError &e)
+    {
+        env->ThrowError("%s: In frame %d: %s", Name(), n, e.what());
+    }
+    const Gradation *curves = frameCurves ? frameCurves.get() : grd.get();
+    std::unique_ptr<Gradation> frameGrd;
+    if (autoCurve)
+    {
+        frameGrd.reset(new Gradation(*curves));
+        autoCurve->apply(*frameGrd, n, vi.num_frames, [&] (int i, double (&bins)[256]) {
+            auto &&frame = child->GetFrame(i, env);
+            FrameContext ctx { *grd, vi.width, vi.height, srcVi, srcVi, getYuvMatrix(frame, env), false, 1,
+                               nullptr, 0, nullptr, nullptr, nullptr, nullptr, nullptr };
+            // The direct path only handles RGB32.
+            accumulateLumaHistogram(ctx, pipeline.read ? pipeline.read : readRowRGB<8>, frame, bins);
+        });
+        curves = frameGrd.get();
+    }
+    YuvMatrix frameMatrix = getYuvMatrix(src, env);
+    // The static curves are referenced without ownership, only to be told apart.
+    CompiledGradation dedupCurves = frameCurves ? frameCurves : CompiledGradation(CompiledGradation(), grd.get());
+    // Automatic curves are new for each frame, so their cache starts empty.
+    PixelCachePool::Entry cacheEntry;
+    if (pixelCaches)
+        cacheEntry = pixelCaches->take(frameGrd ? CompiledGradation() : dedupCurves);
+    PixelCache *frameCache = cacheEntry.second.get();
+    std::unique_ptr<TileDedup::Frame> tiles;
+    if (dedup)
+    {
+        tiles.reset(new TileDedup::Frame);
+        dedup->begin(n, src, dedupCurves, strength.at(n), frameMatrix, *tiles);
+    }
+    if (!pipeline.process && tiles)
+        dedup->forEachDirtyTile(*tiles, [&] (int x, int y, int width, int height) {
+            Run( *curves, width, height,
+                 (uint32_t *) (src->GetReadPtr() + y*src->GetPitch()) + x,
+                 (uint32_t *) (dst->GetWritePtr() + y*dst->GetPitch()) + x,
+                 src->GetPitch(), dst->GetPitch(), frameCache );
+        });
+    else if (!pipeline.process)
+        Run( *curves, vi.width, vi.height,
+             (uint32_t *) src->GetReadPtr(), (uint32_t *) dst->GetWritePtr(),
+             src->GetPitch(), dst->GetPitch(), frameCache );
+    else
+    {
+        PVideoFrame maskFrame = mask ? mask->GetFrame(n, env) : nullptr;
+        const VideoFrame *m = maskFrame.operator->();
+        int maskPlane = mask && mask->GetVideoInfo().IsRGB() ? PLANAR_G : PLANAR_Y;
+        std::unique_ptr<FrameStats> frameStats;
+        if (stats != STATS_NONE)
+        {
+            frameStats.reset(new FrameStats);
+            frameStats->input = stats == STATS_INPUT || stats == STATS_BOTH;
+            frameStats->output = stats == STATS_OUTPUT || stats == STATS_BOTH;
+        }
+        // Automatic curves are new for each frame, so they are not cached.
+        std::shared_ptr<const PreparedCurves> framePrepared;
+        if (frameGrd)
+            framePrepared = std::make_shared<const PreparedCurves>(*frameGrd, pipeline, srcVi.BitsPerComponent());
+        else if (frameCurves)
+            framePrepared = preparedCache->get(frameCurves);
+        const PreparedCurves &curveTables = framePrepared ? *framePrepared : *prepared;
+        FrameContext ctx { *curves, vi.width, vi.height, srcVi, vi, frameMatrix, dither, strength.at(n),
+                           m ? m->GetReadPtr(maskPlane) : nullptr, m ? m->GetPitch(maskPlane) : 0, readMask,
+                           frameStats.get(), curveTables.samples.get(), curveTables.linear.get(), frameCache };
+        if (tiles)
+        {
+            RowBands bands = dedup->bands(*tiles);
+            applyToFrame(ctx, pipeline, src, dst, &bands);
+        }
+        else
+            applyToFrame(ctx, pipeline, src, dst);
+        if (frameStats && frameStats->input)
+            setStatsProps(dst, "_GradationInput", frameStats->in, env);
+        if (frameStats && frameStats->output)
+            setStatsProps(dst, "_Gradation", frameStats->out, env);
+    }
+    if (frameCache)
+    {
+        setCacheProps(dst, *frameCache, env);
+        pixelCaches->give(std::move(cacheEntry));
+    }
+    if (tiles)
+        dedup->finish(n, dedupCurves, strength.at(n), frameMatrix, *tiles, dst);
     return dst;
 }
 
+void GradationFilter::setStatsProps(PVideoFrame &dst, const char *prefix, const ChannelStats (&stats)[3], IScriptEnvironment *env)
+{
+    static const char * const histNames[3] {"HistR", "HistG", "HistB"};
+    AVSMap *props = env->getFramePropsRW(dst);
+    std::string key;
+    int64_t hist[256];
+    for (int c = 0; c < 3; ++c)
+    {
+        for (int i = 0; i < 256; ++i)
+            hist[i] = stats[c].count(i);
+        key.assign(prefix).append(histNames[c]);
+        env->propSetIntArray(props, key.c_str(), hist, 256);
+    }
+    double min[3], max[3];
+    int64_t clippedLow[3], clippedHigh[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        min[c] = stats[c].min;
+        max[c] = stats[c].max;
+        clippedLow[c] = stats[c].clippedLow;
+        clippedHigh[c] = stats[c].clippedHigh;
+    }
+    env->propSetFloatArray(props, key.assign(prefix).append("Min").c_str(), min, 3);
+    env->propSetFloatArray(props, key.assign(prefix).append("Max").c_str(), max, 3);
+    env->propSetIntArray(props, key.assign(prefix).append("ClippedLow").c_str(), clippedLow, 3);
+    env->propSetIntArray(props, key.assign(prefix).append("ClippedHigh").c_str(), clippedHigh, 3);
+}
+
+void GradationFilter::setCacheProps(PVideoFrame &dst, const PixelCache &cache, IScriptEnvironment *env)
+{
+    AVSMap *props = env->getFramePropsRW(dst);
+    env->propSetInt(props, "_GradationCacheHits", cache.hits, 0);
+    env->propSetInt(props, "_GradationCacheRuns", cache.runs, 0);
+    env->propSetFloat(props, "_GradationCacheHitRate", cache.pixels ? double(cache.hits + cache.runs)/cache.pixels : 0, 0);
+}
+
+YuvMatrix GradationFilter::getYuvMatrix(const PVideoFrame &src, IScriptEnvironment *env) const
+{
+    int code = matrix;
+    bool fullRange = false;
+    if (vi.IsYUV() || vi.IsYUVA())
+    {
+        const AVSMap *props = env->getFramePropsRO(src);
+        int err = 0;
+        int64_t range = env->propGetInt(props, "_ColorRange", 0, &err);
+        fullRange = !err && range == 0;
+        if (code == MATRIX_AUTO)
+        {
+            code = (int) env->propGetInt(props, "_Matrix", 0, &err);
+            if (err)
+                code = MATRIX_BT601;
+        }
+    }
+    switch (code)
+    {
+        case MATRIX_BT709:  return {0.2126, 0.0722, fullRange};
+        case MATRIX_BT2020: return {0.2627, 0.0593, fullRange};
+        default:            return {0.299, 0.114, fullRange};
+    }
+}
+
+std::mutex GradationFilter::instancesMutex;
+std::unordered_map<int, const GradationFilter *> GradationFilter::instances;
+int GradationFilter::lastInstanceId;
+
+const GradationFilter *GradationFilter::findInstance(const PClip &clip)
+{
+    if (auto *filter = dynamic_cast<const GradationFilter *>(clip.operator->()))
+        return filter;
+    // Any filter may pass cache hints on to its child, so the answer is only
+    // trusted from the cache and MT guard that AviSynth+ puts around a filter,
+    // and only if the filter found has the same output as the clip.
+    if ( clip->SetCacheHints(CACHE_IS_CACHE_REQ, 0) != CACHE_IS_CACHE_ANS &&
+         clip->SetCacheHints(CACHE_IS_MTGUARD_REQ, 0) != CACHE_IS_MTGUARD_ANS )
+        return nullptr;
+    int id = clip->SetCacheHints(CACHE_GET_GRADATION_INSTANCE, 0);
+    std::lock_guard<std::mutex> lock(instancesMutex);
+    auto it = instances.find(id);
+    if (it == instances.end())
+        return nullptr;
+    const VideoInfo &a = clip->GetVideoInfo(), &b = it->second->vi;
+    bool same = a.width == b.width && a.height == b.height && a.pixel_type == b.pixel_type && a.num_frames == b.num_frames
+             && a.fps_numerator == b.fps_numerator && a.fps_denominator == b.fps_denominator;
+    return same ? it->second : nullptr;
+}
+
+bool GradationFilter::canBeFused(int aPrecision, int aMatrix) const
+// Whether a filter using this instance as input can take over its work.
+{
+    return precision == aPrecision && matrix == aMatrix && !dither && !blendsInKernel() && stats == STATS_NONE && !autoCurve && !curveSource
+        && vi.pixel_type == child->GetVideoInfo().pixel_type;
+}
+
 int GradationFilter::parseEnumImpl(const char *str, const char *argName, const std::pair<const char *, int> *mappings, size_t count, IScriptEnvironment *env)
 {
     for (size_t i = 0; i < count; ++i)
@@ -131,72 +1494,257 @@ CurveFileType GradationFilter::parseCurveFileType(const char *filename, const ch
     if (type != CurveFileType(-1))
         return type;
     size_t length = strlen(filename);
-    if (length >= 4)
+    for (auto &m : curveFileExtensions)
     {
-        const char *ext = filename + length - 4;
-        for (auto &m : curveFileExtensions)
-            if (stricmp(ext, m.first) == 0)
-                return CurveFileType(m.second);
+        size_t extLength = strlen(m.first);
+        if (length >= extLength && stricmp(filename + length - extLength, m.first) == 0)
+            return CurveFileType(m.second);
     }
     env->ThrowError("%s: Cannot determine type of file '%s'", Name(), filename);
     abort();
 }
 
-void GradationFilter::parsePoints(Gradation &grd, DrawMode drawMode, const AVSValue &elems, const char *argName, IScriptEnvironment *env)
+PointSet GradationFilter::parsePoints(ProcessingMode process, const AVSValue &elems, const char *argName, IScriptEnvironment *env)
 {
-    Space space = GetSpace(grd.process);
-    int channelCount = GetChannelCount(space);
-    int firstChannel = GetFirstChannel(space);
-    if (elems.ArraySize() > channelCount)
-        env->ThrowError("%s: Too many lists of points (%d). Space '%s' only has %d channels", Name(), elems.ArraySize(), space_names[space], channelCount);
-    for (int l = 0; l < elems.ArraySize(); ++l)
+    try
     {
-        auto &points = elems[l];
-        if (!points.IsArray())
-            env->ThrowError("%s: In list %d of '%s': Not an array", Name(), l, argName);
-        if (maxPoints < points.ArraySize() )
-            env->ThrowError("%s: In list %d of '%s': Can't have more than %d points", Name(), l, argName, maxPoints);
-        uint8_t outPoints[maxPoints][2];
-        int16_t pos[256] {0};
-        size_t count = 0;
-        for (int p = 0; p < points.ArraySize(); ++p, ++count)
+        return readPoints(process, elems, argName);
+    }
+    catch (const CurveError &e)
+    {
+        env->ThrowError("%s: %s", Name(), e.what());
+        abort();
+    }
+}
+
+std::vector<std::pair<int, PointSet>> GradationFilter::parseKeyframes(ProcessingMode process, const AVSValue &arg, IScriptEnvironment *env)
+{
+    if (!arg.IsArray() || arg.ArraySize() == 0)
+        env->ThrowError("%s: 'keyframes' must be a non-empty array of [frame, points] pairs", Name());
+    std::vector<std::pair<int, PointSet>> keys;
+    std::string argName;
+    for (int i = 0; i < arg.ArraySize(); ++i)
+    {
+        auto &key = arg[i];
+        if (!key.IsArray() || key.ArraySize() != 2 || !key[0].IsInt() || !key[1].IsArray())
+            env->ThrowError("%s: In element %d of 'keyframes': Expected a [frame, points] pair", Name(), i);
+        int frame = key[0].AsInt();
+        if (!keys.empty() && frame <= keys.back().first)
+            env->ThrowError("%s: In element %d of 'keyframes': Frame numbers must be increasing", Name(), i);
+        argName.assign("keyframes[").append(std::to_string(i)).append("]");
+        keys.emplace_back(frame, parsePoints(process, key[1], argName.c_str(), env));
+        auto &first = keys.front().second, &last = keys.back().second;
+        for (int c = 0; c < 5; ++c)
+            if (last.count[c] != first.count[c])
+                env->ThrowError("%s: In element %d of 'keyframes': All keyframes must have the same number of points in each channel", Name(), i);
+    }
+    return keys;
+}
+
+Animated GradationFilter::parseStrength(const AVSValue &arg, IScriptEnvironment *env)
+{
+    auto check = [&] (double value) {
+        if (value < 0 || 1 < value)
+            env->ThrowError("%s: 'strength' must be in the [0, 1] range", Name());
+        return value;
+    };
+    if (!arg.Defined())
+        return {};
+    if (arg.IsFloat())
+        return {check(arg.AsFloat())};
+    if (!arg.IsArray() || arg.ArraySize() == 0)
+        env->ThrowError("%s: 'strength' must be a number or a non-empty array of [frame, strength] pairs", Name());
+    std::vector<std::pair<int, double>> keys;
+    for (int i = 0; i < arg.ArraySize(); ++i)
+    {
+        auto &key = arg[i];
+        if (!key.IsArray() || key.ArraySize() != 2 || !key[0].IsInt() || !key[1].IsFloat())
+            env->ThrowError("%s: In element %d of 'strength': Expected a [frame, strength] pair", Name(), i);
+        int frame = key[0].AsInt();
+        if (!keys.empty() && frame <= keys.back().first)
+            env->ThrowError("%s: In element %d of 'strength': Frame numbers must be increasing", Name(), i);
+        keys.emplace_back(frame, check(key[1].AsFloat()));
+    }
+    return {std::move(keys)};
+}
+
+std::vector<SceneCurves::Scene> GradationFilter::parseScenes(const char *filename, const CurveCompiler &compiler, IScriptEnvironment *env)
+// Each line of the index is either empty, a comment starting with '#', or
+// "<first frame> <last frame> file <curve file>" or "<first frame> <last frame>
+// points <points>", with the points in the syntax of the 'points' argument.
+// Curve files are relative to the index.
+{
+    std::ifstream in(filename);
+    if (!in)
+        env->ThrowError("%s: Cannot open file '%s'", Name(), filename);
+    std::string dir(filename);
+    size_t slash = dir.find_last_of("/\\");
+    dir.resize(slash == std::string::npos ? 0 : slash + 1);
+
+    std::vector<SceneCurves::Scene> scenes;
+    std::unordered_map<std::string, CompiledGradation> compiled;
+    std::string line, key;
+    for (int lineNumber = 1; std::getline(in, line); ++lineNumber)
+    {
+        size_t end = line.find_last_not_of(" \t\r");
+        line.resize(end == std::string::npos ? 0 : end + 1);
+        size_t start = line.find_first_not_of(" \t");
+        if (start == std::string::npos || line[start] == '#')
+            continue;
+        int first, last, offset = 0;
+        char kind[16];
+        if (sscanf(line.c_str(), "%d %d %15s %n", &first, &last, kind, &offset) != 3 || offset == 0)
+            env->ThrowError("%s: In line %d of '%s': Expected '<first> <last> file <file>' or '<first> <last> points <points>'", Name(), lineNumber, filename);
+        if (first < 0 || last < first)
+            env->ThrowError("%s: In line %d of '%s': Invalid frame range %d-%d", Name(), lineNumber, filename, first, last);
+        if (!scenes.empty() && first <= scenes.back().last)
+            env->ThrowError("%s: In line %d of '%s': Frame ranges must be increasing and must not overlap", Name(), lineNumber, filename);
+        const char *arg = line.c_str() + offset;
+        bool isFile = strcmp(kind, "file") == 0;
+        std::string curveFile;
+        PointSet set;
+        if (isFile)
         {
-            auto &point = points[p];
-            if (!point.IsArray() || point.ArraySize() != 2 || !point[0].IsInt() || !point[1].IsInt())
-                env->ThrowError("%s: In point %d of list %d of '%s': Invalid point. Expected an array of two integers", Name(), p, l, argName);
-            int x = point[0].AsInt();
-            int y = point[1].AsInt();
-            if (x < 0 || 255 < x || y < 0 || 255 < y)
-                env->ThrowError("%s: In list %d of '%s': Out-of-range point (%d, %d)", Name(), l, argName, x, y);
-            if (pos[x])
-                env->ThrowError("%s: In list %d of '%s': Points (%d, %d) and (%d, %d) overlap", Name(), l, argName, x, pos[x] - 1, x, y);
-            pos[x] = y + 1;
-            outPoints[count][0] = (uint8_t) x;
-            outPoints[count][1] = (uint8_t) y;
+            bool absolute = arg[0] == '/' || arg[0] == '\\' || (arg[0] && arg[1] == ':');
+            curveFile.assign(absolute ? "" : dir).append(arg);
+            key.assign("file\n").append(curveFile);
         }
-        Channel ch = Channel(l + firstChannel);
-        ImportPoints(grd, ch, outPoints, count, drawMode);
+        else if (strcmp(kind, "points") == 0)
+        {
+            try
+            {
+                set = readPoints(compiler.base.process, TextValue::parse(arg), "points");
+            }
+            catch (const CurveError &e)
+            {
+                env->ThrowError("%s: In line %d of '%s': %s", Name(), lineNumber, filename, e.what());
+            }
+            key.assign("points\n").append(reinterpret_cast<const char *>(&set), sizeof(set));
+        }
+        else
+            env->ThrowError("%s: In line %d of '%s': Unknown entry type '%s'", Name(), lineNumber, filename, kind);
+
+        CompiledGradation &grd = compiled[key];
+        if (!grd && isFile)
+        {
+            grd = compiler.compileFile(curveFile.c_str(), parseCurveFileType(curveFile.c_str(), "auto", "file_type", env));
+            if (!grd)
+                env->ThrowError("%s: In line %d of '%s': Cannot open file '%s'", Name(), lineNumber, filename, curveFile.c_str());
+        }
+        else if (!grd)
+            grd = compiler.compile(set);
+        scenes.push_back({first, last, grd});
+    }
+    return scenes;
+}
+
+Levels GradationFilter::parseLevels(const AVSValue &levels, const AVSValue &range, const char *argName, const char *rangeArgName, IScriptEnvironment *env)
+// Combines the sample range and the levels into a single mapping.
+{
+    Levels result {0, 255, 1};
+    if (levels.Defined())
+    {
+        if (!levels.IsArray() || levels.ArraySize() < 2 || levels.ArraySize() > 3)
+            env->ThrowError("%s: '%s' must be an array of the form [black, white] or [black, white, gamma]", Name(), argName);
+        for (int i = 0; i < levels.ArraySize(); ++i)
+            if (!levels[i].IsFloat())
+                env->ThrowError("%s: In '%s': Element %d is not a number", Name(), argName, i);
+        result.black = levels[0].AsFloat();
+        result.white = levels[1].AsFloat();
+        result.gamma = levels.ArraySize() > 2 ? levels[2].AsFloat() : 1;
+        if (result.black < 0 || 255 < result.black || result.white < 0 || 255 < result.white || result.black == result.white)
+            env->ThrowError("%s: In '%s': Invalid black and white points (%g, %g)", Name(), argName, result.black, result.white);
+        if (result.gamma <= 0)
+            env->ThrowError("%s: In '%s': Gamma must be positive", Name(), argName);
+    }
+    if (parseEnum<int>(range.AsString("full"), rangeArgName, sampleRanges, env) == RANGE_LIMITED)
+    {
+        result.black = 16 + result.black*219/255;
+        result.white = 16 + result.white*219/255;
     }
+    return result;
 }
 
-template <GradationProcesser &process>
-FrameProcesser &GradationFilter::getFrameProcesser(const VideoInfo &vi, IScriptEnvironment *env)
+static bool isYuv444(const VideoInfo &vi)
 {
-    if (!vi.IsRGB())
-        env->ThrowError("%s: Input clip must be RGB(A)", Name());
+    return (vi.IsYUV() || vi.IsYUVA()) && vi.Is444() && vi.BitsPerComponent() <= 16;
+}
+
+MaskReader *GradationFilter::getMaskReader(const VideoInfo &vi, const VideoInfo &maskVi, IScriptEnvironment *env)
+{
+    if (!maskVi.IsPlanar())
+        env->ThrowError("%s: 'mask' must be a planar clip", Name());
+    if (maskVi.width != vi.width || maskVi.height != vi.height)
+        env->ThrowError("%s: 'mask' must have the same dimensions as the input clip", Name());
+    switch (maskVi.BitsPerComponent())
+    {
+        case 8:  return readMaskRow<8>;
+        case 10: return readMaskRow<10>;
+        case 12: return readMaskRow<12>;
+        case 14: return readMaskRow<14>;
+        case 16: return readMaskRow<16>;
+        case 32: return readMaskRow<32>;
+    }
+    env->ThrowError("%s: Unsupported 'mask' pixel type", Name());
+    abort();
+}
+
+RowReader *GradationFilter::getRowReader(const VideoInfo &vi, IScriptEnvironment *env)
+{
+    bool isYuv = isYuv444(vi);
+    if (!vi.IsRGB() && !isYuv)
+        env->ThrowError("%s: Input clip must be RGB(A) or YUV(A)444 up to 16 bits", Name());
     switch (vi.BitsPerComponent())
     {
-        case 8:  return applyToFrame<process, 8>;
-        case 10: return applyToFrame<process, 10>;
-        case 12: return applyToFrame<process, 12>;
-        case 14: return applyToFrame<process, 14>;
-        case 16: return applyToFrame<process, 16>;
-        case 32: return applyToFrame<process, 32>;
+        case 8:  return isYuv ? readRowYUV<8> : readRowRGB<8>;
+        case 10: return isYuv ? readRowYUV<10> : readRowRGB<10>;
+        case 12: return isYuv ? readRowYUV<12> : readRowRGB<12>;
+        case 14: return isYuv ? readRowYUV<14> : readRowRGB<14>;
+        case 16: return isYuv ? readRowYUV<16> : readRowRGB<16>;
+        case 32: return readRowRGB<32>;
     }
     env->ThrowError("%s: Unsupported pixel type", Name());
     abort();
 }
 
+RowWriter *GradationFilter::getRowWriter(const VideoInfo &vi, IScriptEnvironment *env)
+// Pre: 'vi' has been accepted by 'getRowReader', except for the bit depth.
+{
+    bool isYuv = isYuv444(vi);
+    switch (vi.BitsPerComponent())
+    {
+        case 8:  return isYuv ? writeRowYUV<8> : writeRowRGB<8>;
+        case 10: return isYuv ? writeRowYUV<10> : writeRowRGB<10>;
+        case 12: return isYuv ? writeRowYUV<12> : writeRowRGB<12>;
+        case 14: return isYuv ? writeRowYUV<14> : writeRowRGB<14>;
+        case 16: return isYuv ? writeRowYUV<16> : writeRowRGB<16>;
+        case 32: if (!isYuv) return writeRowRGB<32>;
+    }
+    env->ThrowError("%s: Unsupported output pixel type", Name());
+    abort();
+}
+
+int GradationFilter::getOutputPixelType(const VideoInfo &vi, int bits, IScriptEnvironment *env)
+{
+    int sampleBits;
+    switch (bits)
+    {
+        case 8:  sampleBits = VideoInfo::CS_Sample_Bits_8; break;
+        case 10: sampleBits = VideoInfo::CS_Sample_Bits_10; break;
+        case 12: sampleBits = VideoInfo::CS_Sample_Bits_12; break;
+        case 14: sampleBits = VideoInfo::CS_Sample_Bits_14; break;
+        case 16: sampleBits = VideoInfo::CS_Sample_Bits_16; break;
+        case 32: sampleBits = VideoInfo::CS_Sample_Bits_32; break;
+        default: env->ThrowError("%s: Invalid 'output_bits': %d", Name(), bits); abort();
+    }
+    int pixelType = vi.pixel_type;
+    if (vi.IsRGB() && (pixelType & VideoInfo::CS_INTERLEAVED) && bits != 8 && bits != 16)
+        // Packed RGB only exists in 8 and 16 bits.
+        pixelType = pixelType & VideoInfo::CS_RGBA_TYPE ? VideoInfo::CS_GENERIC_RGBAP
+                                                        : VideoInfo::CS_GENERIC_RGBP;
+    return (pixelType & ~VideoInfo::CS_Sample_Bits_Mask) | sampleBits;
+}
+
 // Work around MSVC bug (https://developercommunity.visualstudio.com/t/C-compiler-bug:-unable-to-use-static-m/10262063).
 template <class procMode>
 static inline RGB<double> processDouble(const Gradation &grd, double r, double g, double b)
@@ -204,58 +1752,198 @@ static inline RGB<double> processDouble(const Gradation &grd, double r, double g
     return procMode::processDouble(grd, r, g, b);
 }
 
-static void runGradationOld(const Gradation &grd, int width, int height, int, const PVideoFrame &src, const PVideoFrame &dst)
-// Pre: clip is RGB32.
-{
-    Run( grd, width, height,
-         (uint32_t *) src->GetReadPtr(), (uint32_t *) dst->GetWritePtr(),
-         src->GetPitch(), dst->GetPitch() );
-}
-
 AVSValue __cdecl GradationFilter::Create(AVSValue args, void *, IScriptEnvironment *env)
 {
-    bool precise = args[iPrecise].AsBool(false);
-    auto &&grd = std::make_unique<Gradation>();
-    Init(*grd, precise);
+    const AVSValue &preciseArg = args[iPrecise];
+    if (preciseArg.Defined() && !preciseArg.IsBool() && !preciseArg.IsString())
+        env->ThrowError("%s: 'precise' must be a bool, \"float\" or \"double\"", Name());
+    int precision = preciseArg.IsString() ? parseEnum<int>(preciseArg.AsString(), "precise", precisions, env)
+                  : preciseArg.AsBool(false) ? PRECISION_FLOAT : PRECISION_INTEGER;
+    bool precise = precision != PRECISION_INTEGER;
+    CurveCompiler compiler {};
+    Init(compiler.base, precise);
 
     if (!args[iProcess].IsString())
         env->ThrowError("%s: Missing parameter 'process'", Name());
     if (args[iPoints].Defined() && !args[iPoints].IsArray())
         env->ThrowError("%s: 'points' is not an array", Name());
-    if (!args[iPoints].IsArray() && !args[iFile].IsString())
-        env->ThrowError("%s: No 'points' and no 'file' provided", Name());
-    if (args[iPoints].IsArray() && args[iFile].IsString())
-        env->ThrowError("%s: Only one of 'points', 'file' can be provided at a time", Name());
-
-    grd->process = parseEnum<ProcessingMode>(args[iProcess].AsString(), "process", processingModes, env);
-    DrawMode drawMode = parseEnum<DrawMode>(args[iCurveType].AsString("spline"), "curve_type", drawModes, env);
-    if (args[iPoints].IsArray())
-        parsePoints(*grd, drawMode, args[iPoints], "points", env);
+    int autoMethod = parseEnum<int>(args[iAuto].AsString("none"), "auto", autoCurveMethods, env);
+    int curveArgs = args[iPoints].IsArray() + args[iFile].IsString() + args[iKeyframes].Defined();
+    if (curveArgs == 0 && autoMethod == AUTOCURVE_NONE && !args[iScenes].Defined() && !args[iPointsProp].Defined() && !args[iPointsVar].Defined())
+        env->ThrowError("%s: No 'points', 'file', 'keyframes' or 'scenes' provided", Name());
+    bool runtimePoints = args[iPointsProp].Defined() || args[iPointsVar].Defined();
+    bool watch = args[iWatch].AsBool(false);
+    if (args[iKeyframes].Defined() + args[iScenes].Defined() + runtimePoints + watch + args[iControl].Defined() > 1)
+        env->ThrowError("%s: Only one of 'keyframes', 'scenes', 'points_prop'/'points_var', 'watch', 'control' can be provided at a time", Name());
+    if (watch && !args[iFile].IsString())
+        env->ThrowError("%s: 'watch' requires 'file'", Name());
+    int watchInterval = args[iWatchInterval].AsInt(500);
+    if (watchInterval <= 0)
+        env->ThrowError("%s: 'watch_interval' must be positive", Name());
+    if (curveArgs > 1)
+        env->ThrowError("%s: Only one of 'points', 'file', 'keyframes' can be provided at a time", Name());
+
+    ProcessingMode mode = parseEnum<ProcessingMode>(args[iProcess].AsString(), "process", processingModes, env);
+    compiler.base.process = mode;
+    compiler.drawMode = parseEnum<DrawMode>(args[iCurveType].AsString("spline"), "curve_type", drawModes, env);
+
+    compiler.inputLevels = parseLevels(args[iInputLevels], args[iInputRange], "input_levels", "input_range", env);
+    compiler.outputLevels = parseLevels(args[iOutputLevels], args[iOutputRange], "output_levels", "output_range", env);
+    compiler.hasLevels = args[iInputLevels].Defined() || args[iOutputLevels].Defined() ||
+                         args[iInputRange].Defined() || args[iOutputRange].Defined();
+    if (compiler.hasLevels && !isPerChannelRgb(mode))
+        env->ThrowError("%s: Levels and ranges are only supported for the 'rgb' and 'full' processing modes", Name());
+
+    std::unique_ptr<AutoCurve> autoCurve;
+    if (autoMethod != AUTOCURVE_NONE)
+    {
+        if (!isPerChannelRgb(mode))
+            env->ThrowError("%s: 'auto' is only supported for the 'rgb' and 'full' processing modes", Name());
+        if (compiler.hasLevels)
+            env->ThrowError("%s: 'auto' cannot be combined with levels or ranges", Name());
+        int radius = args[iAutoRadius].AsInt(0);
+        double percentile = args[iAutoPercentile].AsFloat(0.5);
+        double limit = args[iAutoLimit].AsFloat(1);
+        if (radius < 0)
+            env->ThrowError("%s: 'auto_radius' cannot be negative", Name());
+        if (percentile < 0 || 50 <= percentile)
+            env->ThrowError("%s: 'auto_percentile' must be in the [0, 50) range", Name());
+        if (limit < 0 || 1 < limit)
+            env->ThrowError("%s: 'auto_limit' must be in the [0, 1] range", Name());
+        // Gamma curves need three points.
+        DrawMode autoDrawMode = compiler.drawMode == DRAWMODE_GAMMA ? DRAWMODE_LINEAR : compiler.drawMode;
+        autoCurve.reset(new AutoCurve(AutoCurveMethod(autoMethod), autoDrawMode, radius, percentile/100, limit));
+    }
+
+    // When possible, the strength is applied to the curves, and otherwise when
+    // processing each row. The automatic curve is only known when processing.
+    Animated strength = parseStrength(args[iStrength], env);
+    if (strength.isConstant() && !autoCurve && isPerChannelRgb(mode))
+    {
+        compiler.bakeStrength = true;
+        compiler.strength = strength.at(0);
+        strength = {};
+    }
+
+    auto &&grd = std::make_unique<Gradation>(compiler.base);
+    std::unique_ptr<CurveSource> curveSource;
+    if (args[iKeyframes].Defined())
+    {
+        auto &&keys = parseKeyframes(mode, args[iKeyframes], env);
+        *grd = *compiler.compile(keys.front().second);
+        curveSource.reset(new KeyframedCurves(compiler, std::move(keys)));
+    }
     else
     {
-        CurveFileType type = parseCurveFileType(args[iFile].AsString(), args[iFileType].AsString("auto"), "file_type", env);
-        if (!ImportCurve(*grd, args[iFile].AsString(), type, drawMode))
-            env->ThrowError("%s: Cannot open file '%s'", Name(), args[iFile].AsString());
+        if (args[iPoints].IsArray())
+            compiler.import(*grd, parsePoints(mode, args[iPoints], "points", env));
+        else if (args[iFile].IsString())
+        {
+            CurveFileType type = parseCurveFileType(args[iFile].AsString(), args[iFileType].AsString("auto"), "file_type", env);
+            bool imported = watch ? compiler.importFileCopy(*grd, args[iFile].AsString(), type)
+                                  : ImportCurve(*grd, args[iFile].AsString(), type, compiler.drawMode);
+            if (!imported)
+                env->ThrowError("%s: Cannot open file '%s'", Name(), args[iFile].AsString());
+            if (watch)
+                curveSource.reset(new WatchedCurves(compiler, args[iFile].AsString(), type, watchInterval));
+        }
+        compiler.finish(*grd);
+        if (args[iScenes].Defined())
+            curveSource.reset(new SceneCurves(parseScenes(args[iScenes].AsString(), compiler, env)));
+        else if (runtimePoints)
+            curveSource.reset(new RuntimeCurves(compiler, args[iPointsProp].AsString(""), args[iPointsVar].AsString("")));
+        else if (args[iControl].Defined())
+        {
+#ifndef _WIN32
+            auto *controlled = new ControlledCurves(compiler, args[iControl].AsString());
+            curveSource.reset(controlled);
+            std::string error = controlled->start();
+            if (!error.empty())
+                env->ThrowError("%s: Cannot listen on '%s': %s", Name(), args[iControl].AsString(), error.c_str());
+#else
+            env->ThrowError("%s: 'control' is not supported on this platform", Name());
+#endif
+        }
     }
 
-    PreCalcLut(*grd);
+    PClip mask = args[iMask].Defined() ? args[iMask].AsClip() : nullptr;
+    bool blendInKernel = !strength.isConstant() || strength.at(0) != 1 || mask;
+    int stats = parseEnum<int>(args[iStats].AsString("none"), "stats", statsModes, env);
+
+    int matrix = parseEnum<int>(args[iMatrix].AsString("auto"), "matrix", yuvMatrices, env);
+    bool dither = args[iDither].AsBool(false);
 
     auto &&child = args[iChild].AsClip();
+    // Chained Gradation filters are combined into one, so that the frame is
+    // only traversed once.
+    auto *inner = findInstance(child);
+    if (inner && !blendInKernel && stats == STATS_NONE && !autoCurve && !curveSource)
+        if (inner->canBeFused(precision, matrix) && ComposeCurves(*grd, *inner->grd))
+            child = inner->child;
+
+    if (args[iExportFile].Defined())
+    {
+        const char *filename = args[iExportFile].AsString();
+        if (!ExportCurve(*grd, filename, parseCurveFileType(filename, "auto", "export_file", env)))
+            env->ThrowError("%s: Cannot write file '%s'", Name(), filename);
+    }
+
     auto &vi = child->GetVideoInfo();
-    if (precise)
+    int outputBits = args[iOutputBits].AsInt(vi.BitsPerComponent());
+    if (!precise && outputBits != 8)
+        env->ThrowError("%s: 'output_bits' other than 8 requires 'precise=true'", Name());
+
+    bool cache = args[iCache].AsBool(false);
+    bool dedup = args[iDedup].AsBool(false);
+    if (dedup && (mask || stats != STATS_NONE || autoCurve))
+        env->ThrowError("%s: 'dedup' cannot be combined with 'mask', 'stats' or 'auto'", Name());
+    if (cache && (precise || (grd->process != PROCMODE_YUV && grd->process != PROCMODE_HSV && grd->process != PROCMODE_CMYK)))
+        env->ThrowError("%s: 'cache' is only supported for the 'yuv', 'hsv' and 'cmyk' processing modes without 'precise'", Name());
+
+    RowProcesser *process = nullptr;
+    if (precise && (grd->process == PROCMODE_RGB || grd->process == PROCMODE_FULL) && vi.IsRGB() && vi.BitsPerComponent() <= 16)
+        // Integer RGB samples map to the curves with a single lookup.
+        process = processRowSamples;
+    else if (precise && grd->process == PROCMODE_RGBW && vi.IsRGB() && vi.BitsPerComponent() <= 16)
+        process = processRowWeightedSamples<false>;
+    else if (precise && grd->process == PROCMODE_FULLW && vi.IsRGB() && vi.BitsPerComponent() <= 16)
+        process = processRowWeightedSamples<true>;
+    else if (precise)
         switch (grd->process)
         {
-            case PROCMODE_RGB: return new GradationFilter(child, grd, getFrameProcesser<processDouble<procModeRgb>>(vi, env));
-            case PROCMODE_FULL: return new GradationFilter(child, grd, getFrameProcesser<processDouble<procModeFull>>(vi, env));
-            case PROCMODE_YUV: return new GradationFilter(child, grd, getFrameProcesser<processDouble<procModeYuv>>(vi, env));
-            case PROCMODE_HSV: return new GradationFilter(child, grd, getFrameProcesser<processDouble<procModeHsv>>(vi, env));
+            case PROCMODE_RGB: process = processRowLinear<processRow<processDouble<procModeRgb>>>; break;
+            case PROCMODE_FULL: process = processRowLinear<processRow<processDouble<procModeFull>>>; break;
+            case PROCMODE_RGBW: process = processRow<processDouble<procModeRgbw>>; break;
+            case PROCMODE_FULLW: process = processRow<processDouble<procModeFullw>>; break;
+            case PROCMODE_YUV:
+                process = precision == PRECISION_FLOAT ? processRowFloat<procModeYuv::processFloat> : processRow<processDouble<procModeYuv>>;
+                break;
+            case PROCMODE_HSV:
+                process = precision == PRECISION_FLOAT ? processRowFloat<procModeHsv::processFloat> : processRow<processDouble<procModeHsv>>;
+                break;
+            case PROCMODE_CMYK: process = processRow<processDouble<procModeCmyk>>; break;
+            case PROCMODE_LAB: process = processRow<processDouble<procModeLab>>; break;
             default: env->ThrowError("%s: 'precise' not supported for processing mode '%s'", Name(), args[iProcess].AsString());
         }
+    else if (!vi.IsRGB32() && (!isYuv444(vi) || vi.BitsPerComponent() != 8))
+        env->ThrowError("%s: Input clip must be RGB32 or 8-bit YUV(A)444", Name());
+    else if (!vi.IsRGB32() || blendInKernel || stats != STATS_NONE)
+        // RGB32 only needs the row pipeline to blend or gather statistics.
+        process = processRowInt;
 
-    if (!vi.IsRGB32())
-        env->ThrowError("%s: Input clip must be RGB32", Name());
+    int outPixelType = getOutputPixelType(vi, outputBits, env);
+    VideoInfo outVi = vi;
+    outVi.pixel_type = outPixelType;
+    // Dithering is only applied when the bit depth goes down, so that output
+    // at the same or a higher depth stays exact. Float input counts as deeper
+    // than any integer output.
+    dither = dither && outVi.BitsPerComponent() < vi.BitsPerComponent();
+    if (!process)
+        return new GradationFilter(child, grd, {}, precision, matrix, outPixelType, dither, std::move(strength), nullptr, nullptr, stats, autoCurve, curveSource, cache, dedup);
 
-    return new GradationFilter(child, grd, runGradationOld);
+    MaskReader *readMask = mask ? getMaskReader(vi, mask->GetVideoInfo(), env) : nullptr;
+    FramePipeline pipeline {getRowReader(vi, env), process, getRowWriter(outVi, env)};
+    return new GradationFilter(child, grd, pipeline, precision, matrix, outPixelType, dither, std::move(strength), mask, readMask, stats, autoCurve, curveSource, cache, dedup);
 }
 
 const AVS_Linkage *AVS_linkage = 0;
@@ -1,12 +1,19 @@
 #ifndef GRADATION_AVS_H
 #define GRADATION_AVS_H
 
+#include <algorithm>
 #include <type_traits>
+#include <utility>
+#include <vector>
 #include <avisynth.h>
 #include "gradation.h"
 #include "util.h"
 
 static const int planesRGB[4] {PLANAR_B, PLANAR_G, PLANAR_R, PLANAR_A};
+static const int planesYUV[4] {PLANAR_V, PLANAR_Y, PLANAR_U, PLANAR_A};
+
+enum { iB, iG, iR, iA };
+enum { iV = iB, iY = iG, iU = iR };
 
 template<int bpc>
 struct PixelTraits
@@ -25,64 +32,642 @@ struct PixelTraits
         { return (bpc == 32) ? 1 : (1LL << bpc) - 1; }
 };
 
+struct FrameFormat
+{
+    bool isYuv;
+    bool hasAlpha;
+    int step; // Distance between consecutive samples of a component, in samples.
+    int bpc;
+
+    FrameFormat(const VideoInfo &vi) :
+        isYuv(vi.IsYUV() || vi.IsYUVA()),
+        hasAlpha(vi.IsRGB() ? (vi.pixel_type & VideoInfo::CS_RGBA_TYPE) != 0 : vi.IsYUVA()),
+        step(vi.IsRGB() && (vi.pixel_type & VideoInfo::CS_INTERLEAVED) ? 3 + hasAlpha : 1),
+        bpc(vi.BitsPerComponent())
+    {
+    }
+
+    int componentCount() const
+        { return 3 + hasAlpha; }
+
+    bool isPacked() const
+        { return step > 1; }
+};
+
+struct YuvMatrix
+{
+    double kr, kb;
+    bool fullRange;
+};
+
+// Samples of one row, one array per component, in the [0, 255] range.
+struct RowBuffer
+{
+    int width;
+    int begin, end; // Range of samples to be processed.
+    std::vector<double> r, g, b, a;
+    std::vector<double> r0, g0, b0; // Input samples, when they are needed after processing.
+    std::vector<double> weight; // Blending of the output with the input, in the [0, 1] range.
+    std::vector<uint32_t> packed;
+    std::vector<float> rf, gf, bf; // Samples for the single-precision kernels.
+
+    RowBuffer(int aWidth) :
+        width(aWidth), begin(0), end(aWidth),
+        r(aWidth), g(aWidth), b(aWidth), a(aWidth)
+    {
+    }
+};
+
+// Histogram in the [0, 255] range, minimum, maximum and number of samples at
+// either end of the range.
+struct ChannelStats
+{
+    uint32_t hist[4][256]; // Interleaved partial histograms, so that
+                           // consecutive samples rarely update the same counter.
+    double min, max;
+    int64_t clippedLow, clippedHigh;
+
+    ChannelStats() :
+        hist {{0}}, min(255), max(0), clippedLow(0), clippedHigh(0)
+    {
+    }
+
+    void accumulate(const double *v, int width)
+    {
+        int x = 0;
+        for (; x + 4 <= width; x += 4)
+            for (int i = 0; i < 4; ++i)
+                ++hist[i][int(clamp(v[x + i], 0.0, 255.0) + 0.5)];
+        for (; x < width; ++x)
+            ++hist[0][int(clamp(v[x], 0.0, 255.0) + 0.5)];
+        for (x = 0; x < width; ++x)
+        {
+            min = v[x] < min ? v[x] : min;
+            max = max < v[x] ? v[x] : max;
+            clippedLow += v[x] <= 0;
+            clippedHigh += v[x] >= 255;
+        }
+    }
+
+    uint32_t count(int bin) const
+        { return hist[0][bin] + hist[1][bin] + hist[2][bin] + hist[3][bin]; }
+};
+
+struct FrameStats
+{
+    bool input, output; // Which statistics to gather.
+    ChannelStats in[3], out[3]; // R, G, B.
+
+    static void accumulate(ChannelStats (&stats)[3], const RowBuffer &row)
+    {
+        stats[0].accumulate(row.r.data(), row.width);
+        stats[1].accumulate(row.g.data(), row.width);
+        stats[2].accumulate(row.b.data(), row.width);
+    }
+};
+
+// The curves of the RGB and RGB + R/G/B modes sampled at every code value of an
+// integer RGB input, so that processing takes a single lookup per sample, or
+// what the weighted modes need to do the same.
+struct CurveSamples
+{
+    std::vector<float> r, g, b; // Empty in the RGB weighted mode.
+    std::vector<float> delta; // Weighted modes: change applied by the RGB curve.
+    double scale; // From the [0, 255] range to indices.
+
+    CurveSamples(const Gradation &grd, int bpc) :
+        scale(((size_t(1) << bpc) - 1)/255.0)
+    {
+        const size_t count = size_t(1) << bpc;
+        if (grd.process == PROCMODE_RGBW || grd.process == PROCMODE_FULLW)
+        {
+            delta.resize(count);
+            CalcCurveSamples(grd, CHANNEL_RGB, count, delta.data());
+            for (size_t i = 0; i < count; ++i)
+                delta[i] -= float(i/scale);
+            if (grd.process == PROCMODE_FULLW)
+            {
+                r.resize(count), g.resize(count), b.resize(count);
+                CalcCurveSamples(grd, CHANNEL_RED, count, r.data());
+                CalcCurveSamples(grd, CHANNEL_GREEN, count, g.data());
+                CalcCurveSamples(grd, CHANNEL_BLUE, count, b.data());
+            }
+            return;
+        }
+        r.resize(count), g.resize(count), b.resize(count);
+        CalcRgbSamples(grd, CHANNEL_RED, count, r.data());
+        CalcRgbSamples(grd, CHANNEL_GREEN, count, g.data());
+        CalcRgbSamples(grd, CHANNEL_BLUE, count, b.data());
+    }
+};
+
+// The curves of the RGB and RGB + R/G/B modes as linear segments, found once
+// per set of curves for processRowLinear.
+struct LinearCurves
+{
+    bool simple; // Whether all the curves used are linear with few segments.
+    LinearSegments rgb, single[3];
 
-using FrameProcesser = void(const Gradation &grd, int width, int height, int pixel_type, const PVideoFrame &src, const PVideoFrame &dst);
+    explicit LinearCurves(const Gradation &grd)
+    {
+        bool full = grd.process == PROCMODE_FULL;
+        simple = GetLinearSegments(grd, CHANNEL_RGB, rgb);
+        for (int c = 0; c < 3; ++c)
+            simple = simple && (!full || GetLinearSegments(grd, Channel(CHANNEL_RED + c), single[c]));
+    }
+};
+
+struct FrameContext;
+using MaskReader = void(const FrameContext &ctx, const BYTE *maskp, RowBuffer &row);
+
+struct FrameContext
+{
+    const Gradation &grd;
+    int width, height;
+    FrameFormat srcFormat, dstFormat;
+    YuvMatrix matrix;
+    bool dither;
+    double strength; // Blending of the output with the input, if not already in the curves.
+    const BYTE *mask; // First plane of the mask frame, or null.
+    int maskPitch;
+    MaskReader *readMask;
+    FrameStats *stats; // Null if no statistics are gathered.
+    const CurveSamples *samples; // Only used by processRowSamples and processRowWeightedSamples.
+    const LinearCurves *linear; // Only used by processRowLinear.
+    PixelCache *cache; // Null if results are not cached.
+};
+
+
+using RowReader = void(const FrameContext &ctx, const BYTE * const (&srcp)[4], RowBuffer &row);
+using RowProcesser = void(const FrameContext &ctx, RowBuffer &row);
+using RowWriter = void(const FrameContext &ctx, const RowBuffer &row, int y, BYTE * const (&dstp)[4]);
 using GradationProcesser = RGB<double>(const Gradation &grd, double r, double g, double b);
 
-template <GradationProcesser &process, int bpc>
-inline void applyToFrame(const Gradation &grd, int width, int height, int pixel_type, const PVideoFrame &src, const PVideoFrame &dst)
-// Pre: clip is RGB(A).
+struct FramePipeline
+{
+    RowReader *read;
+    RowProcesser *process;
+    RowWriter *write;
+};
+
+template <class pixel_t>
+static inline pixel_t readSample(const BYTE *p, int x)
+{
+    return ((const pixel_t *) p)[x];
+}
+
+template <class pixel_t>
+static inline void writeSample(BYTE *p, int x, pixel_t v)
+{
+    ((pixel_t *) p)[x] = v;
+}
+
+template <int bpc>
+inline void readRowRGB(const FrameContext &ctx, const BYTE * const (&srcp)[4], RowBuffer &row)
 {
     using pixel_t = typename PixelTraits<bpc>::pixel_t;
-    enum { iB, iG, iR, iA };
+    constexpr pixel_t maxValue = PixelTraits<bpc>::maxValue();
+    constexpr double multiplier = 255.0/maxValue;
+    int step = ctx.srcFormat.step;
+    for (int x = 0; x < row.width; ++x)
+    {
+        row.r[x] = clamp<pixel_t>(readSample<pixel_t>(srcp[iR], x*step), 0, maxValue)*multiplier;
+        row.g[x] = clamp<pixel_t>(readSample<pixel_t>(srcp[iG], x*step), 0, maxValue)*multiplier;
+        row.b[x] = clamp<pixel_t>(readSample<pixel_t>(srcp[iB], x*step), 0, maxValue)*multiplier;
+    }
+    if (ctx.srcFormat.hasAlpha)
+        for (int x = 0; x < row.width; ++x)
+            row.a[x] = readSample<pixel_t>(srcp[iA], x*step)*multiplier;
+}
 
-    bool hasAlpha = pixel_type & VideoInfo::CS_RGBA_TYPE;
-    bool isPacked = pixel_type & VideoInfo::CS_INTERLEAVED;
-    int nComponents = 3 + hasAlpha;
-    int packSize = isPacked ? (hasAlpha ? 4 : 3) : 1;
+// 8x8 Bayer matrix, normalized to offsets in the (-0.5, 0.5) range.
+struct OrderedDither
+{
+    double offsets[8][8];
 
-    const BYTE *srcp[4];
-    BYTE *dstp[4];
-    for (int p = 0; p < nComponents; ++p)
+    OrderedDither()
+    {
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 8; ++x)
+            {
+                int v = 0, xy = x ^ y;
+                for (int bit = 0; bit < 3; ++bit)
+                    v = (v << 2) | (((xy >> bit) & 1) << 1) | ((y >> bit) & 1);
+                offsets[y][x] = (v + 0.5)/64 - 0.5;
+            }
+    }
+};
+
+static inline const double *getDitherRow(const FrameContext &ctx, int y)
+// Returns the rounding offsets for row 'y'. Indices must be wrapped at 8.
+{
+    static const OrderedDither ordered;
+    static const double none[8] {0};
+    return ctx.dither ? ordered.offsets[y & 7] : none;
+}
+
+template <int bpc>
+inline void writeRowRGB(const FrameContext &ctx, const RowBuffer &row, int y, BYTE * const (&dstp)[4])
+{
+    using pixel_t = typename PixelTraits<bpc>::pixel_t;
+    constexpr double multiplier = 255.0/PixelTraits<bpc>::maxValue();
+    constexpr bool isInt = bpc < 32;
+    const double *dither = getDitherRow(ctx, y);
+    int step = ctx.dstFormat.step;
+    for (int x = 0; x < row.width; ++x)
+    {
+        double offset = isInt*(0.5 + dither[x & 7]);
+        writeSample(dstp[iR], x*step, pixel_t(row.r[x]/multiplier + offset));
+        writeSample(dstp[iG], x*step, pixel_t(row.g[x]/multiplier + offset));
+        writeSample(dstp[iB], x*step, pixel_t(row.b[x]/multiplier + offset));
+    }
+    if (ctx.dstFormat.hasAlpha)
+        for (int x = 0; x < row.width; ++x)
+            writeSample(dstp[iA], x*step, pixel_t(row.a[x]/multiplier + isInt*0.5));
+}
+
+// Offset and excursion of the luma and chroma samples, in code values.
+template <int bpc>
+struct YuvCoding
+{
+    double yOffset, yRange, cOffset, cRange;
+
+    YuvCoding(bool fullRange)
+    {
+        constexpr double scale = double(1 << (bpc - 8));
+        constexpr double maxValue = PixelTraits<bpc>::maxValue();
+        yOffset = fullRange ? 0 : 16*scale;
+        yRange = fullRange ? maxValue : 219*scale;
+        cOffset = 128*scale;
+        cRange = fullRange ? maxValue : 224*scale;
+    }
+};
+
+template <int bpc>
+inline void readRowYUV(const FrameContext &ctx, const BYTE * const (&srcp)[4], RowBuffer &row)
+// Pre: bpc < 32.
+{
+    using pixel_t = typename PixelTraits<bpc>::pixel_t;
+    const YuvCoding<bpc> c(ctx.matrix.fullRange);
+    const double kr = ctx.matrix.kr, kb = ctx.matrix.kb, kg = 1 - kr - kb;
+    for (int x = 0; x < row.width; ++x)
+    {
+        double y = (readSample<pixel_t>(srcp[iY], x) - c.yOffset)/c.yRange;
+        double u = (readSample<pixel_t>(srcp[iU], x) - c.cOffset)/c.cRange;
+        double v = (readSample<pixel_t>(srcp[iV], x) - c.cOffset)/c.cRange;
+        double r = y + 2*(1 - kr)*v;
+        double b = y + 2*(1 - kb)*u;
+        double g = (y - kr*r - kb*b)/kg;
+        row.r[x] = clamp(255*r, 0.0, 255.0);
+        row.g[x] = clamp(255*g, 0.0, 255.0);
+        row.b[x] = clamp(255*b, 0.0, 255.0);
+    }
+    if (ctx.srcFormat.hasAlpha)
+        for (int x = 0; x < row.width; ++x)
+            row.a[x] = readSample<pixel_t>(srcp[iA], x)*(255.0/PixelTraits<bpc>::maxValue());
+}
+
+template <int bpc>
+inline void writeRowYUV(const FrameContext &ctx, const RowBuffer &row, int rowIndex, BYTE * const (&dstp)[4])
+// Pre: bpc < 32.
+{
+    using pixel_t = typename PixelTraits<bpc>::pixel_t;
+    constexpr double maxValue = PixelTraits<bpc>::maxValue();
+    const YuvCoding<bpc> c(ctx.matrix.fullRange);
+    const double kr = ctx.matrix.kr, kb = ctx.matrix.kb, kg = 1 - kr - kb;
+    const double *dither = getDitherRow(ctx, rowIndex);
+    for (int x = 0; x < row.width; ++x)
+    {
+        double r = row.r[x]/255, g = row.g[x]/255, b = row.b[x]/255;
+        double y = kr*r + kg*g + kb*b;
+        double u = (b - y)/(2*(1 - kb));
+        double v = (r - y)/(2*(1 - kr));
+        double offset = 0.5 + dither[x & 7];
+        writeSample(dstp[iY], x, pixel_t(clamp(y*c.yRange + c.yOffset + offset, 0.0, maxValue)));
+        writeSample(dstp[iU], x, pixel_t(clamp(u*c.cRange + c.cOffset + offset, 0.0, maxValue)));
+        writeSample(dstp[iV], x, pixel_t(clamp(v*c.cRange + c.cOffset + offset, 0.0, maxValue)));
+    }
+    if (ctx.dstFormat.hasAlpha)
+        for (int x = 0; x < row.width; ++x)
+            writeSample(dstp[iA], x, pixel_t(row.a[x]*(maxValue/255) + 0.5));
+}
+
+inline bool isFlatRow(const RowBuffer &row)
+// Whether all samples to be processed have the same colour.
+{
+    const int begin = row.begin, end = row.end;
+    if (begin >= end)
+        return false;
+    const double r = row.r[begin], g = row.g[begin], b = row.b[begin];
+    for (int x = begin; x < end; x += 16)
+    {
+        bool diff = false;
+        for (int i = x; i < std::min(x + 16, end); ++i)
+            diff |= (row.r[i] != r) | (row.g[i] != g) | (row.b[i] != b);
+        if (diff)
+            return false;
+    }
+    return true;
+}
+
+template <GradationProcesser &process>
+inline void processRow(const FrameContext &ctx, RowBuffer &row)
+{
+    if (isFlatRow(row)) // e.g. black borders
+    {
+        RGB<double> out = process(ctx.grd, row.r[row.begin], row.g[row.begin], row.b[row.begin]);
+        std::fill(row.r.begin() + row.begin, row.r.begin() + row.end, out.r);
+        std::fill(row.g.begin() + row.begin, row.g.begin() + row.end, out.g);
+        std::fill(row.b.begin() + row.begin, row.b.begin() + row.end, out.b);
+        return;
+    }
+    for (int x = row.begin; x < row.end; ++x)
+    {
+        RGB<double> out = process(ctx.grd, row.r[x], row.g[x], row.b[x]);
+        row.r[x] = out.r;
+        row.g[x] = out.g;
+        row.b[x] = out.b;
+    }
+}
+
+template <void (&process)(const Gradation &, float *, float *, float *, size_t)>
+inline void processRowFloat(const FrameContext &ctx, RowBuffer &row)
+// Runs a single-precision kernel on the samples to be processed.
+{
+    const int begin = row.begin, count = row.end - row.begin;
+    if (count <= 0)
+        return;
+    row.rf.resize(row.width), row.gf.resize(row.width), row.bf.resize(row.width);
+    for (int x = begin; x < row.end; ++x)
+    {
+        row.rf[x] = float(row.r[x]);
+        row.gf[x] = float(row.g[x]);
+        row.bf[x] = float(row.b[x]);
+    }
+    process(ctx.grd, &row.rf[begin], &row.gf[begin], &row.bf[begin], count);
+    for (int x = begin; x < row.end; ++x)
+    {
+        row.r[x] = row.rf[x];
+        row.g[x] = row.gf[x];
+        row.b[x] = row.bf[x];
+    }
+}
+
+inline void processRowInt(const FrameContext &ctx, RowBuffer &row)
+// Runs the integer kernels on a row which has been quantized to 8 bits.
+{
+    row.packed.resize(row.width);
+    for (int x = row.begin; x < row.end; ++x)
+        row.packed[x] = packRGB({
+            uint8_t(row.r[x] + 0.5),
+            uint8_t(row.g[x] + 0.5),
+            uint8_t(row.b[x] + 0.5),
+        });
+    uint32_t *p = row.packed.data() + row.begin;
+    Run(ctx.grd, row.end - row.begin, 1, p, p, 0, 0, ctx.cache);
+    for (int x = row.begin; x < row.end; ++x)
+    {
+        auto out = unpackRGB(row.packed[x]);
+        row.r[x] = out.r;
+        row.g[x] = out.g;
+        row.b[x] = out.b;
+    }
+}
+
+inline void processRowSamples(const FrameContext &ctx, RowBuffer &row)
+// Pre: the row was read from integer RGB samples, with the bit depth of 'ctx.samples'.
+{
+    const CurveSamples &s = *ctx.samples;
+    for (int x = row.begin; x < row.end; ++x)
     {
-        if (isPacked)
+        row.r[x] = s.r[int(row.r[x]*s.scale + 0.5)];
+        row.g[x] = s.g[int(row.g[x]*s.scale + 0.5)];
+        row.b[x] = s.b[int(row.b[x]*s.scale + 0.5)];
+    }
+}
+
+template <bool perChannel>
+inline void processRowWeightedSamples(const FrameContext &ctx, RowBuffer &row)
+// Same for the weighted modes, which move all components by the change of
+// their weighted average, interpolated between the samples.
+{
+    const CurveSamples &s = *ctx.samples;
+    const int last = int(s.delta.size()) - 1;
+    for (int x = row.begin; x < row.end; ++x)
+    {
+        double r = row.r[x], g = row.g[x], b = row.b[x];
+        if (perChannel)
         {
-            srcp[p] = src->GetReadPtr() + p*sizeof(pixel_t);
-            dstp[p] = dst->GetWritePtr() + p*sizeof(pixel_t);
+            r = s.r[int(r*s.scale + 0.5)];
+            g = s.g[int(g*s.scale + 0.5)];
+            b = s.b[int(b*s.scale + 0.5)];
         }
-        else
+        double bw = clamp((77*r + 150*g + 29*b)/256*s.scale, 0.0, double(last));
+        int i = std::min(int(bw), last - 1);
+        double delta = s.delta[i] + (bw - i)*(s.delta[i + 1] - s.delta[i]);
+        row.r[x] = clamp(r + delta, 0.0, 255.0);
+        row.g[x] = clamp(g + delta, 0.0, 255.0);
+        row.b[x] = clamp(b + delta, 0.0, 255.0);
+    }
+}
+
+template <int count>
+inline void applyLinearSegments(const LinearSegments &s, double *v, int begin, int end)
+{
+    for (int x = begin; x < end; ++x)
+    {
+        double y = s.y0;
+        for (int i = 0; i < count; ++i)
+            y += s.slope[i]*(clamp(v[x], s.x[i], s.x[i + 1]) - s.x[i]);
+        v[x] = y;
+    }
+}
+
+inline void applyLinearSegments(const LinearSegments &s, std::vector<double> &v, int begin, int end)
+{
+    switch (s.count)
+    {
+        case 1: applyLinearSegments<1>(s, v.data(), begin, end); break;
+        case 2: applyLinearSegments<2>(s, v.data(), begin, end); break;
+        case 3: applyLinearSegments<3>(s, v.data(), begin, end); break;
+        default: break; // Identity.
+    }
+}
+
+template <RowProcesser &fallback>
+inline void processRowLinear(const FrameContext &ctx, RowBuffer &row)
+// Evaluates the curves of the RGB and RGB + R/G/B modes arithmetically when
+// they are linear with few segments, and with 'fallback' otherwise.
+{
+    const LinearCurves &linear = *ctx.linear;
+    if (!linear.simple)
+        return fallback(ctx, row);
+    bool full = ctx.grd.process == PROCMODE_FULL;
+    std::vector<double> *channels[3] {&row.r, &row.g, &row.b};
+    for (int c = 0; c < 3; ++c)
+    {
+        if (full)
+            applyLinearSegments(linear.single[c], *channels[c], row.begin, row.end);
+        applyLinearSegments(linear.rgb, *channels[c], row.begin, row.end);
+    }
+}
+
+template <int bpc>
+inline void readMaskRow(const FrameContext &ctx, const BYTE *maskp, RowBuffer &row)
+// Sets the blending weights and narrows the processing range to the non-zero mask samples.
+{
+    using pixel_t = typename PixelTraits<bpc>::pixel_t;
+    const double scale = ctx.strength/PixelTraits<bpc>::maxValue();
+    row.begin = row.width;
+    row.end = 0;
+    for (int x = 0; x < row.width; ++x)
+    {
+        pixel_t v = readSample<pixel_t>(maskp, x);
+        row.weight[x] = clamp(v*scale, 0.0, 1.0);
+        if (v > 0)
         {
-            srcp[p] = src->GetReadPtr(planesRGB[p]);
-            dstp[p] = dst->GetWritePtr(planesRGB[p]);
+            row.begin = row.begin < x ? row.begin : x;
+            row.end = x + 1;
         }
     }
-    int srcPitch = src->GetPitch(),
-        dstPitch = dst->GetPitch();
+}
+
+inline void blendRow(RowBuffer &row)
+// out = in + weight*(out - in).
+{
+    for (int x = row.begin; x < row.end; ++x)
+    {
+        double w = row.weight[x];
+        row.r[x] = clamp(row.r0[x] + w*(row.r[x] - row.r0[x]), 0.0, 255.0);
+        row.g[x] = clamp(row.g0[x] + w*(row.g[x] - row.g0[x]), 0.0, 255.0);
+        row.b[x] = clamp(row.b0[x] + w*(row.b[x] - row.b0[x]), 0.0, 255.0);
+    }
+}
+
+static inline int getPlane(const FrameFormat &format, int c)
+{
+    return format.isPacked() ? 0 : (format.isYuv ? planesYUV : planesRGB)[c];
+}
+
+static inline int sampleSize(const FrameFormat &format)
+{
+    return format.bpc == 8 ? 1 : format.bpc == 32 ? 4 : 2;
+}
 
-    for (int y = 0; y < height; ++y)
+static inline void getReadPointers(const FrameFormat &format, const PVideoFrame &src, const BYTE *(&srcp)[4], int (&srcPitch)[4])
+{
+    for (int c = 0; c < format.componentCount(); ++c)
     {
-        for (int x = 0; x < packSize*width; x += packSize)
+        int plane = getPlane(format, c);
+        int offset = format.isPacked() ? c*sampleSize(format) : 0;
+        srcp[c] = src->GetReadPtr(plane) + offset;
+        srcPitch[c] = src->GetPitch(plane);
+    }
+}
+
+inline void accumulateLumaHistogram(const FrameContext &ctx, RowReader *read, const PVideoFrame &src, double (&hist)[256])
+// Adds the BT.601 luma of every pixel in 'src' to 'hist'.
+{
+    const BYTE *srcp[4];
+    int srcPitch[4];
+    getReadPointers(ctx.srcFormat, src, srcp, srcPitch);
+    RowBuffer row(ctx.width);
+    uint32_t counts[256] {0};
+    for (int y = 0; y < ctx.height; ++y)
+    {
+        read(ctx, srcp, row);
+        for (int x = 0; x < row.width; ++x)
+            ++counts[int(0.299*row.r[x] + 0.587*row.g[x] + 0.114*row.b[x] + 0.5)];
+        for (int c = 0; c < ctx.srcFormat.componentCount(); ++c)
+            srcp[c] += srcPitch[c];
+    }
+    for (int i = 0; i < 256; ++i)
+        hist[i] += counts[i];
+}
+
+// Columns to process in each band of 'height' rows, in the memory order of the
+// source. Bands with an empty range are skipped altogether.
+struct RowBands
+{
+    int height;
+    std::vector<std::pair<int, int>> ranges;
+};
+
+inline void applyToFrame(const FrameContext &ctx, const FramePipeline &pipeline, const PVideoFrame &src, const PVideoFrame &dst,
+                         const RowBands *bands = nullptr)
+// Pre: 'bands' is null if 'ctx' has a mask.
+{
+    const BYTE *srcp[4];
+    BYTE *dstp[4];
+    int srcPitch[4], dstPitch[4];
+    getReadPointers(ctx.srcFormat, src, srcp, srcPitch);
+    for (int c = 0; c < ctx.dstFormat.componentCount(); ++c)
+    {
+        int plane = getPlane(ctx.dstFormat, c);
+        int offset = ctx.dstFormat.isPacked() ? c*sampleSize(ctx.dstFormat) : 0;
+        dstp[c] = dst->GetWritePtr(plane) + offset;
+        dstPitch[c] = dst->GetPitch(plane);
+        if (ctx.srcFormat.isPacked() != ctx.dstFormat.isPacked())
+        {
+            // Packed RGB is stored bottom-up.
+            dstp[c] += (ctx.height - 1)*dstPitch[c];
+            dstPitch[c] = -dstPitch[c];
+        }
+    }
+
+    const BYTE *maskp = ctx.mask;
+    int maskPitch = ctx.maskPitch;
+    if (maskp && ctx.srcFormat.isPacked())
+    {
+        maskp += (ctx.height - 1)*maskPitch;
+        maskPitch = -maskPitch;
+    }
+    bool inPlace = src.operator->() == dst.operator->();
+
+    RowBuffer row(ctx.width);
+    bool blend = ctx.strength != 1 || maskp;
+    if (blend)
+        row.weight.assign(ctx.width, ctx.strength);
+    for (int y = 0; y < ctx.height; ++y)
+    {
+        if (maskp)
+        {
+            ctx.readMask(ctx, maskp, row);
+            maskp += maskPitch;
+        }
+        bool skip = false;
+        if (bands)
         {
-            constexpr pixel_t maxValue = PixelTraits<bpc>::maxValue();
-            constexpr double multiplier = 255.0/maxValue;
-            constexpr bool isInt = bpc < 32;
-            RGB<double> in {
-                clamp<pixel_t>(((pixel_t *) srcp[iR])[x], 0, maxValue)*multiplier,
-                clamp<pixel_t>(((pixel_t *) srcp[iG])[x], 0, maxValue)*multiplier,
-                clamp<pixel_t>(((pixel_t *) srcp[iB])[x], 0, maxValue)*multiplier,
-            };
-            RGB<double> out = process(grd, in.r, in.g, in.b);
-            ((pixel_t *) dstp[iR])[x] = pixel_t(out.r/multiplier + isInt*0.5);
-            ((pixel_t *) dstp[iG])[x] = pixel_t(out.g/multiplier + isInt*0.5);
-            ((pixel_t *) dstp[iB])[x] = pixel_t(out.b/multiplier + isInt*0.5);
-            if (hasAlpha)
-                ((pixel_t *) dstp[iA])[x] = ((pixel_t *) srcp[iA])[x];
+            auto &range = bands->ranges[y/bands->height];
+            row.begin = range.first;
+            row.end = range.second;
+            skip = row.begin >= row.end;
         }
-        for (int p = 0; p < nComponents; ++p)
+        if (!skip && (row.begin < row.end || !inPlace || ctx.stats))
         {
-            srcp[p] += srcPitch;
-            dstp[p] += dstPitch;
+            pipeline.read(ctx, srcp, row);
+            if (ctx.stats && ctx.stats->input)
+                ctx.stats->accumulate(ctx.stats->in, row);
+            if (row.begin < row.end)
+            {
+                if (blend)
+                {
+                    row.r0 = row.r;
+                    row.g0 = row.g;
+                    row.b0 = row.b;
+                }
+                pipeline.process(ctx, row);
+                if (blend)
+                    blendRow(row);
+            }
+            if (ctx.stats && ctx.stats->output)
+                ctx.stats->accumulate(ctx.stats->out, row);
+            pipeline.write(ctx, row, y, dstp);
         }
+        for (int c = 0; c < ctx.srcFormat.componentCount(); ++c)
+            srcp[c] += srcPitch[c];
+        for (int c = 0; c < ctx.dstFormat.componentCount(); ++c)
+            dstp[c] += dstPitch[c];
     }
 }
 
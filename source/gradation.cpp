@@ -21,9 +21,21 @@
 
 #include "gradation.h"
 
+#include <limits>
+#include <vector>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
@@ -36,13 +48,22 @@ template <class T>
 struct HSV { T h, s, v; };
 template <class T>
 struct YUV { T y, u, v; };
+template <class T>
+struct CMYK { T c, m, y, k; };
+template <class T>
+struct LAB { T l, a, b; };
 
 static inline double interpolateCurveValue(const double y[256], double x);
+static void interpolateCurveValues(const double y[256], float *v, size_t count);
 
 static HSV<double> rgb2hsv(double r, double g, double b);
 static RGB<double> hsv2rgb(double h, double s, double v);
 static YUV<double> rgb2yuv(double r, double g, double b);
 static RGB<double> yuv2rgb(double y, double u, double v);
+static CMYK<double> rgb2cmyk(double r, double g, double b);
+static RGB<double> cmyk2rgb(double c, double m, double y, double k);
+static LAB<double> rgb2lab(double r, double g, double b);
+static RGB<double> lab2rgb(double l, double a, double b);
 
 ///////////////////////////////////////////////////////////////////////////
 
@@ -51,7 +72,7 @@ int labrgb[16777216];
 static bool labprecalc;
 
 void PreCalcLut(Gradation &grd) {
-    if (grd.Labprecalc==0 && grd.process==PROCMODE_LAB) { // build up the LUT for the Lab process if it is not precalculated already
+    if (grd.Labprecalc==0 && grd.process==PROCMODE_LAB && !grd.precise) { // build up the LUT for the Lab process if it is not precalculated already
         if (!labprecalc) {
             labprecalc = true;
             PreCalcRgb2Lab(rgblab);
@@ -74,7 +95,14 @@ static inline RGB<uint8_t> processIntWithDoublePrecision(const Gradation &grd, u
 
 
 template <class procMode>
-static inline void processFrame(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uint32_t *dst, int32_t src_modulo, int32_t dst_modulo)
+static inline RGB<uint8_t> processPixel(const Gradation &grd, RGB<uint8_t> in)
+{
+    return grd.precise ? processIntWithDoublePrecision<procMode>(grd, in.r, in.g, in.b)
+                       : procMode::processInt(grd, in.r, in.g, in.b);
+}
+
+template <RGB<uint8_t> (&process)(const Gradation &, uint8_t, uint8_t, uint8_t)>
+static inline void processFrameWith(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uint32_t *dst, int32_t src_modulo, int32_t dst_modulo)
 {
     for (int32_t h = 0; h < height; h++)
     {
@@ -82,10 +110,7 @@ static inline void processFrame(const Gradation &grd, int32_t width, int32_t hei
         {
             uint32_t old_pixel = *src++;
             auto in = unpackRGB(old_pixel);
-            auto out =
-                grd.precise ? processIntWithDoublePrecision<procMode>(grd, in.r, in.g, in.b)
-                            : procMode::processInt(grd, in.r, in.g, in.b);
-            uint32_t new_pixel = packRGB(out) | (old_pixel & 0xFF000000U);
+            uint32_t new_pixel = packRGB(process(grd, in.r, in.g, in.b)) | (old_pixel & 0xFF000000U);
             *dst++ = new_pixel;
         }
         src = (uint32_t *)((char *)src + src_modulo);
@@ -93,25 +118,127 @@ static inline void processFrame(const Gradation &grd, int32_t width, int32_t hei
     }
 }
 
-void Run(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uint32_t *dst, int32_t src_pitch, int32_t dst_pitch) {
+template <class procMode>
+static inline void processFrame(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uint32_t *dst, int32_t src_modulo, int32_t dst_modulo)
+// For the modes which are cheap per pixel. The choice of kernel is kept out of
+// the loop.
+{
+    if (grd.precise)
+        processFrameWith<processIntWithDoublePrecision<procMode>>(grd, width, height, src, dst, src_modulo, dst_modulo);
+    else
+        processFrameWith<procMode::processInt>(grd, width, height, src, dst, src_modulo, dst_modulo);
+}
+
+template <class procMode>
+static inline void processFrameCached(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uint32_t *dst, int32_t src_modulo, int32_t dst_modulo, PixelCache &cache)
+// Same as processFrame, but repeats the result of the previous pixel for runs of
+// the same colour, and looks up other colours in 'cache' before processing them.
+{
+    for (int32_t h = 0; h < height; h++)
+    {
+        uint32_t last_in = PixelCache::empty, last_out = 0;
+        for (int32_t w = 0; w < width; w++)
+        {
+            uint32_t old_pixel = *src++;
+            uint32_t in = old_pixel & 0xFFFFFFU;
+            if (in == last_in)
+                ++cache.runs;
+            else
+            {
+                uint32_t i = (in*0x9E3779B1U) >> (32 - PixelCache::bits); // Fibonacci hashing.
+                if (cache.keys[i] == in)
+                    ++cache.hits;
+                else
+                {
+                    cache.keys[i] = in;
+                    cache.values[i] = packRGB(processPixel<procMode>(grd, unpackRGB(in)));
+                }
+                last_in = in;
+                last_out = cache.values[i];
+            }
+            *dst++ = last_out | (old_pixel & 0xFF000000U);
+        }
+        cache.pixels += width;
+        src = (uint32_t *)((char *)src + src_modulo);
+        dst = (uint32_t *)((char *)dst + dst_modulo);
+    }
+}
+
+static inline bool isFlatRow(const uint32_t *src, int32_t width)
+// Whether all pixels of the row have the same colour, regardless of alpha.
+{
+    const uint32_t first = src[0] & 0xFFFFFFU;
+    int32_t w = 0;
+    for (; w + 16 <= width; w += 16)
+    {
+        uint32_t diff = 0;
+        for (int i = 0; i < 16; ++i)
+            diff |= (src[w + i] & 0xFFFFFFU) ^ first;
+        if (diff)
+            return false;
+    }
+    for (; w < width; ++w)
+        if ((src[w] & 0xFFFFFFU) != first)
+            return false;
+    return true;
+}
+
+template <class procMode>
+static inline void processFrameAdaptive(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uint32_t *dst, int32_t src_modulo, int32_t dst_modulo)
+// Same as processFrame, but rows of a single colour (e.g. black borders) are
+// processed once, and gray pixels (r == g == b) are looked up in a table of
+// results filled on first use, since they only depend on one value.
+{
+    uint32_t gray[256];
+    bool grayKnown[256] = {false};
+    for (int32_t h = 0; h < height; h++)
+    {
+        if (width > 0 && isFlatRow(src, width))
+        {
+            uint32_t new_pixel = packRGB(processPixel<procMode>(grd, unpackRGB(src[0])));
+            for (int32_t w = 0; w < width; w++)
+                dst[w] = new_pixel | (src[w] & 0xFF000000U);
+            src += width;
+            dst += width;
+        }
+        else
+            for (int32_t w = 0; w < width; w++)
+            {
+                uint32_t old_pixel = *src++;
+                uint32_t new_pixel;
+                if (((old_pixel ^ (old_pixel >> 8)) & 0xFFFFU) == 0)
+                {
+                    uint8_t v = old_pixel & 0xFF;
+                    if (!grayKnown[v])
+                    {
+                        gray[v] = packRGB(processPixel<procMode>(grd, {v, v, v}));
+                        grayKnown[v] = true;
+                    }
+                    new_pixel = gray[v];
+                }
+                else
+                    new_pixel = packRGB(processPixel<procMode>(grd, unpackRGB(old_pixel)));
+                *dst++ = new_pixel | (old_pixel & 0xFF000000U);
+            }
+        src = (uint32_t *)((char *)src + src_modulo);
+        dst = (uint32_t *)((char *)dst + dst_modulo);
+    }
+}
+
+template <class procMode>
+static inline void processFrame(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uint32_t *dst, int32_t src_modulo, int32_t dst_modulo, PixelCache *cache)
+// For the modes which are expensive per pixel.
+{
+    if (cache)
+        processFrameCached<procMode>(grd, width, height, src, dst, src_modulo, dst_modulo, *cache);
+    else
+        processFrameAdaptive<procMode>(grd, width, height, src, dst, src_modulo, dst_modulo);
+}
+
+void Run(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uint32_t *dst, int32_t src_pitch, int32_t dst_pitch, PixelCache *cache) {
     int32_t w, h;
 
-    int r;
-    int g;
-    int b;
-    int bw;
-    int div;
-    int divh;
-    int v;
-    int x;
-    int y;
-    int z;
-    int rr;
-    int gg;
-    int bb;
-    int lab;
-
-    uint32_t old_pixel, new_pixel, med_pixel;
+    uint32_t old_pixel, new_pixel;
     int32_t src_modulo = src_pitch - width*sizeof(*src);
     int32_t dst_modulo = dst_pitch - width*sizeof(*dst);
 
@@ -124,51 +251,10 @@ void Run(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uin
         processFrame<procModeFull>(grd, width, height, src, dst, src_modulo, dst_modulo);
     break;
     case PROCMODE_RGBW:
-        for (h = 0; h < height; h++)
-        {
-            for (w = 0; w < width; w++)
-            {
-                old_pixel = *src++;
-                r = (old_pixel & 0xFF0000);
-                g = (old_pixel & 0x00FF00);
-                b = (old_pixel & 0x0000FF);
-                bw = int((77 * (r >> 16) + 150 * (g >> 8) + 29 * b)>>8);
-                    r = r+grd.rvalue[2][bw];
-                    if (r<65536) r=0; else if (r>16711680) r=16711680;
-                    g = g+grd.gvalue[2][bw];
-                    if (g<256) g=0; else if (g>65280) g=65280;
-                    b = b+grd.bvalue[bw];
-                    if (b<0) b=0; else if (b>255) b=255;
-                new_pixel = (r+g+b);
-                *dst++ = new_pixel | (old_pixel & 0xFF000000U);
-            }
-            src = (uint32_t *)((char *)src + src_modulo);
-            dst = (uint32_t *)((char *)dst + dst_modulo);
-        }
+        processFrame<procModeRgbw>(grd, width, height, src, dst, src_modulo, dst_modulo);
     break;
     case PROCMODE_FULLW:
-        for (h = 0; h < height; h++)
-        {
-            for (w = 0; w < width; w++)
-            {
-                old_pixel = *src++;
-                med_pixel = grd.rvalue[1][(old_pixel & 0xFF0000)>>16] + grd.gvalue[1][(old_pixel & 0x00FF00)>>8] + grd.ovalue(3, old_pixel & 0x0000FF);
-                r = (med_pixel & 0xFF0000);
-                g = (med_pixel & 0x00FF00);
-                b = (med_pixel & 0x0000FF);
-                bw = int((77 * (r >> 16) + 150 * (g >> 8) + 29 * b)>>8);
-                    r = r+grd.rvalue[2][bw];
-                    if (r<65536) r=0; else if (r>16711680) r=16711680;
-                    g = g+grd.gvalue[2][bw];
-                    if (g<256) g=0; else if (g>65280) g=65280;
-                    b = b+grd.bvalue[bw];
-                    if (b<0) b=0; else if (b>255) b=255;
-                new_pixel = (r+g+b);
-                *dst++ = new_pixel | (old_pixel & 0xFF000000U);
-            }
-            src = (uint32_t *)((char *)src + src_modulo);
-            dst = (uint32_t *)((char *)dst + dst_modulo);
-        }
+        processFrame<procModeFullw>(grd, width, height, src, dst, src_modulo, dst_modulo);
     break;
     case PROCMODE_OFF:
         for (h = 0; h < height; h++)
@@ -184,81 +270,16 @@ void Run(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uin
         }
     break;
     case PROCMODE_YUV:
-        processFrame<procModeYuv>(grd, width, height, src, dst, src_modulo, dst_modulo);
+        processFrame<procModeYuv>(grd, width, height, src, dst, src_modulo, dst_modulo, cache);
     break;
     case PROCMODE_CMYK:
-        for (h = 0; h < height; h++)
-        {
-            for (w = 0; w < width; w++)
-            {
-                old_pixel = *src++;
-                r = ((old_pixel & 0xFF0000)>>16);
-                g = ((old_pixel & 0x00FF00)>>8);
-                b = (old_pixel & 0x0000FF);
-                if(r>=g && r>=b) { /* r is Maximum */
-                    v = 255-r;
-                    div  = r+1;
-                    divh = div>>1;
-                    x = 0;
-                    y = (((r-g)<<8) + divh)/div;  //correct rounding  yy+(div>>1)
-                    z = (((r-b)<<8) + divh)/div;} //correct rounding  zz+(div>>1)
-                else if(g>=b) {/* g is maximum */
-                    v = 255-g;
-                    div  = g+1;
-                    divh = div>>1;
-                    x = (((g-r)<<8) + divh)/div;  //correct rounding  xx+(div>>1)
-                    y = 0;
-                    z = (((g-b)<<8) + divh)/div;} //correct rounding  zz+(div>>1)
-                else {/* b is maximum */
-                    v = 255-b;
-                    div  = b+1;
-                    divh = div>>1;
-                    x = (((b-r)<<8) + divh)/div; //correct rounding  xx+(div>>1)
-                    y = (((b-g)<<8) + divh)/div; //correct rounding  yy+(div>>1)
-                    z = 0;}
-                // Applying the curves
-                x = grd.ovalue(1, x);
-                y = grd.ovalue(2, y);
-                z = grd.ovalue(3, z);
-                v = grd.ovalue(4, v);
-                // CMYK to RGB
-                r = 255-((((x*(256-v))+128)>>8)+v); //correct rounding rr+128;
-                if (r<0) r=0;
-                g = 255-((((y*(256-v))+128)>>8)+v); //correct rounding gg+128;
-                if (g<0) g=0;
-                b = 255-((((z*(256-v))+128)>>8)+v); //correct rounding bb+128;
-                if (b<0) b=0;
-                new_pixel = ((r<<16)+(g<<8)+b);
-                *dst++ = new_pixel | (old_pixel & 0xFF000000U);
-            }
-            src = (uint32_t *)((char *)src + src_modulo);
-            dst = (uint32_t *)((char *)dst + dst_modulo);
-        }
+        processFrame<procModeCmyk>(grd, width, height, src, dst, src_modulo, dst_modulo, cache);
     break;
     case PROCMODE_HSV:
-        processFrame<procModeHsv>(grd, width, height, src, dst, src_modulo, dst_modulo);
+        processFrame<procModeHsv>(grd, width, height, src, dst, src_modulo, dst_modulo, cache);
     break;
     case PROCMODE_LAB:
-        for (h = 0; h < height; h++)
-        {
-            for (w = 0; w < width; w++)
-            {
-                old_pixel = *src++;
-                lab = rgblab[(old_pixel & 0xFFFFFF)];
-                rr = (lab & 0xFF0000)>>16;
-                gg = (lab & 0x00FF00)>>8;
-                bb = (lab & 0x0000FF);
-                // Applying the curves
-                x = grd.ovalue(1, rr);
-                y = grd.ovalue(2, gg);
-                z = grd.ovalue(3, bb);
-                //Lab to XYZ
-                new_pixel = labrgb[((x<<16)+(y<<8)+z)];
-                *dst++ = new_pixel | (old_pixel & 0xFF000000U);
-            }
-            src = (uint32_t *)((char *)src + src_modulo);
-            dst = (uint32_t *)((char *)dst + dst_modulo);
-        }
+        processFrame<procModeLab>(grd, width, height, src, dst, src_modulo, dst_modulo, cache);
     break;
     }
 }
@@ -293,93 +314,109 @@ void Init(Gradation &grd, bool precise) {
     }
 }
 
-void CalcCurve(Gradation &grd, Channel channel)
+static void CalcSplineCoefficients(const uint8_t (*pt)[2], int n, double a[], double b[], double c[])
+// Natural cubic spline y = a*t^3 + b*t^2 + c*t + y0 on each segment, with
+// t = x - x0. The b coefficients are the solution of a tridiagonal system,
+// solved with the Thomas algorithm.
+{
+    double lower[maxPoints];
+    double diag[maxPoints];
+    double upper[maxPoints];
+    double y[maxPoints];
+    int i;
+
+    for (i=0;i<n-2;i++) {
+        lower[i]=double(pt[i+1][0]-pt[i][0]);
+        diag[i]=double(2*(pt[i+2][0]-pt[i][0]));
+        upper[i]=double(pt[i+2][0]-pt[i+1][0]);
+        y[i]=3*(double(pt[i+2][1]-pt[i+1][1])/double(pt[i+2][0]-pt[i+1][0])-double(pt[i+1][1]-pt[i][1])/double(pt[i+1][0]-pt[i][0]));
+    }
+    for (i=0;i<n-3;i++) { // forward elimination
+        double div=lower[i+1]/diag[i];
+        diag[i+1]=diag[i+1]-upper[i]*div;
+        y[i+1]=y[i+1]-y[i]*div;
+    }
+    b[0]=0;
+    b[n-1]=0;
+    if (n>2) {b[n-2]=y[n-3]/diag[n-3];}
+    for (i=n-3;i>0;i--) {b[i]=(y[i-1]-upper[i-1]*b[i+1])/diag[i-1];} // backward substitution
+
+    for (i=0;i<(n-1);i++){ //get the a and c coefficients
+        a[i]=(double(b[i+1]-b[i])/double(3*(pt[i+1][0]-pt[i][0])));
+        c[i]=double(pt[i+1][1]-pt[i][1])/double(pt[i+1][0]-pt[i][0])-double(b[i+1]-b[i])*double(pt[i+1][0]-pt[i][0])/3-b[i]*(pt[i+1][0]-pt[i][0]);}
+}
+
+static double CalcGammaExponent(const uint8_t (*pt)[2])
+{
+    int dx=pt[2][0]-pt[0][0];
+    int dy=pt[2][1]-pt[0][1];
+    int dxg=pt[1][0]-pt[0][0];
+    int dyg=pt[1][1]-pt[0][1];
+    return log(double(dyg)/double(dy))/log(double(dxg)/double(dx));
+}
+
+void CalcCurve(Gradation &grd, Channel channel, int firstPoint, int lastPoint)
+// Only the part of the curve which depends on the points from 'firstPoint' to
+// 'lastPoint' is updated, which is local for linear curves. Spline and gamma
+// curves are always updated as a whole.
 {
     int c1;
     int c2;
     int dx;
     int dy;
-    int dxg;
-    int dyg;
     int i;
-    int j;
-    double div;
-    double inc;
-    double ofs;
     double ga;
-    double x[maxPoints][maxPoints];
-    double y[maxPoints];
-    double a[maxPoints];
-    double b[maxPoints];
-    double c[maxPoints];
+    const int n = grd.poic[channel];
+    const uint8_t (*pt)[2] = grd.drwpoint[channel];
+    int lo = 0; // Range of the table to update.
+    int hi = 255;
 
-    if (grd.drwpoint[channel][0][0]>0) {
-        for (c2=0;c2<grd.drwpoint[channel][0][0];c2++) {
-            grd.ovalue(channel, c2, grd.drwpoint[channel][0][1]);
+    if (grd.drwmode[channel] == DRAWMODE_LINEAR) {
+        firstPoint = MAX(firstPoint, 0);
+        lastPoint = MIN(lastPoint, n-1);
+        if (firstPoint > 0) {lo = pt[firstPoint-1][0];}
+        if (lastPoint < n-1) {hi = pt[lastPoint+1][0];}
+    }
+    if (lo == 0 && pt[0][0]>0) {
+        for (c2=0;c2<pt[0][0];c2++) {
+            grd.ovalue(channel, c2, pt[0][1]);
         }
     }
     switch (grd.drwmode[channel]){
         case DRAWMODE_LINEAR:
-            for (c1=0; c1<(grd.poic[channel]-1); c1++){
-                div=(grd.drwpoint[channel][(c1+1)][0]-grd.drwpoint[channel][c1][0]);
-                inc=(grd.drwpoint[channel][(c1+1)][1]-grd.drwpoint[channel][c1][1])/div;
-                ofs=grd.drwpoint[channel][c1][1]-inc*grd.drwpoint[channel][c1][0];
-                for (c2 = grd.drwpoint[channel][c1][0]; c2 < grd.drwpoint[channel][c1+1][0]+1; ++c2) {
+            for (c1=MAX(firstPoint-1, 0); c1<MIN(lastPoint+1, n-1); c1++){
+                double div=(pt[(c1+1)][0]-pt[c1][0]);
+                double inc=(pt[(c1+1)][1]-pt[c1][1])/div;
+                double ofs=pt[c1][1]-inc*pt[c1][0];
+                int end=pt[c1+1][0]+(c1==n-2); // the next segment starts at the end point
+                for (c2 = pt[c1][0]; c2 < end; ++c2) {
                     grd.ovaluef(channel, c2, c2*inc+ofs);
                 }
             }
             break;
-        case DRAWMODE_SPLINE:
-            for (i=0;i<maxPoints;i++){ //clear tables
-                for (j=0;j<maxPoints;j++) {x[i][j]=0;}
-                y[i]=0;
-                a[i]=0;
-                b[i]=0;
-                c[i]=0;}
-
-            if (grd.poic[channel]>3) { //curve has more than 3 coordinates
-                j=grd.poic[channel]-3; //fill the matrix needed to calculate the b coefficients of the cubic functions an*x^3+bn*x^2+cn*x+dn
-                x[0][0]=double(2*(grd.drwpoint[channel][2][0]-grd.drwpoint[channel][0][0]));
-                x[0][1]=double((grd.drwpoint[channel][2][0]-grd.drwpoint[channel][1][0]));
-                y[0]=3*(double(grd.drwpoint[channel][2][1]-grd.drwpoint[channel][1][1])/double(grd.drwpoint[channel][2][0]-grd.drwpoint[channel][1][0])-double(grd.drwpoint[channel][1][1]-grd.drwpoint[channel][0][1])/double(grd.drwpoint[channel][1][0]-grd.drwpoint[channel][0][0]));
-                for (i=1;i<j;i++){
-                    x[i][i-1]=double((grd.drwpoint[channel][i+1][0]-grd.drwpoint[channel][i][0]));
-                    x[i][i]=double(2*(grd.drwpoint[channel][i+2][0]-grd.drwpoint[channel][i][0]));
-                    x[i][i+1]=double((grd.drwpoint[channel][i+2][0]-grd.drwpoint[channel][i+1][0]));
-                    y[i]=3*(double(grd.drwpoint[channel][i+2][1]-grd.drwpoint[channel][i+1][1])/double(grd.drwpoint[channel][i+2][0]-grd.drwpoint[channel][i+1][0])-double(grd.drwpoint[channel][i+1][1]-grd.drwpoint[channel][i][1])/double(grd.drwpoint[channel][i+1][0]-grd.drwpoint[channel][i][0]));
-                }
-                x[j][j-1]=double(grd.drwpoint[channel][j+1][0]-grd.drwpoint[channel][j][0]);
-                x[j][j]=double(2*(grd.drwpoint[channel][j+2][0]-grd.drwpoint[channel][j][0]));
-                y[j]=3*(double(grd.drwpoint[channel][j+2][1]-grd.drwpoint[channel][j+1][1])/double(grd.drwpoint[channel][j+2][0]-grd.drwpoint[channel][j+1][0])-double(grd.drwpoint[channel][j+1][1]-grd.drwpoint[channel][j][1])/double(grd.drwpoint[channel][j+1][0]-grd.drwpoint[channel][j][0]));
-
-                for (i=0;i<grd.poic[channel]-3;i++) { //resolve the matrix to get the b coefficients
-                    div=x[i+1][i]/x[i][i];
-                    x[i+1][i]=x[i+1][i]-x[i][i]*div;
-                    x[i+1][i+1]=x[i+1][i+1]-x[i][i+1]*div;
-                    x[i+1][i+2]=x[i+1][i+2]-x[i][i+2]*div;
-                    y[i+1]=y[i+1]-y[i]*div;}
-                b[grd.poic[channel]-2]=y[grd.poic[channel]-3]/x[grd.poic[channel]-3][grd.poic[channel]-3]; //last b coefficient
-                for (i=grd.poic[channel]-3;i>0;i--) {b[i]=(y[i-1]-x[i-1][i]*b[i+1])/x[i-1][i-1];} // backward subsitution to get the rest of the the b coefficients
-            }
-            else if (grd.poic[channel]==3) { //curve has 3 coordinates
-                b[1]=3*(double(grd.drwpoint[channel][2][1]-grd.drwpoint[channel][1][1])/double(grd.drwpoint[channel][2][0]-grd.drwpoint[channel][1][0])-double(grd.drwpoint[channel][1][1]-grd.drwpoint[channel][0][1])/double(grd.drwpoint[channel][1][0]-grd.drwpoint[channel][0][0]))/double(2*(grd.drwpoint[channel][2][0]-grd.drwpoint[channel][0][0]));}
-
-            for (c2=0;c2<(grd.poic[channel]-1);c2++){ //get the a and c coefficients
-                a[c2]=(double(b[c2+1]-b[c2])/double(3*(grd.drwpoint[channel][c2+1][0]-grd.drwpoint[channel][c2][0])));
-                c[c2]=double(grd.drwpoint[channel][c2+1][1]-grd.drwpoint[channel][c2][1])/double(grd.drwpoint[channel][c2+1][0]-grd.drwpoint[channel][c2][0])-double(b[c2+1]-b[c2])*double(grd.drwpoint[channel][c2+1][0]-grd.drwpoint[channel][c2][0])/3-b[c2]*(grd.drwpoint[channel][c2+1][0]-grd.drwpoint[channel][c2][0]);}
-            for (c1=0;c1<(grd.poic[channel]-1);c1++){ //calculate the y values of the spline curve
-                for (c2 = grd.drwpoint[channel][c1][0]; c2 < grd.drwpoint[channel][c1+1][0]+1; ++c2) {
-                    double vy = a[c1]*(c2-grd.drwpoint[channel][c1][0])*(c2-grd.drwpoint[channel][c1][0])*(c2-grd.drwpoint[channel][c1][0])+b[c1]*(c2-grd.drwpoint[channel][c1][0])*(c2-grd.drwpoint[channel][c1][0])+c[c1]*(c2-grd.drwpoint[channel][c1][0])+grd.drwpoint[channel][c1][1];
+        case DRAWMODE_SPLINE: {
+            double a[maxPoints];
+            double b[maxPoints];
+            double c[maxPoints];
+            CalcSplineCoefficients(pt, n, a, b, c);
+            for (c1=0;c1<(n-1);c1++){ //calculate the y values of the spline curve by forward differences
+                double vy=pt[c1][1];
+                double d1=a[c1]+b[c1]+c[c1];
+                double d2=6*a[c1]+2*b[c1];
+                double d3=6*a[c1];
+                for (c2 = pt[c1][0]; c2 < pt[c1+1][0]+1; ++c2) {
                     grd.ovaluef(channel, c2, MIN(MAX(vy, 0.0), 255.0));
+                    vy+=d1;
+                    d1+=d2;
+                    d2+=d3;
                 }
             }
             break;
+        }
         case DRAWMODE_GAMMA:
             dx=grd.drwpoint[channel][2][0]-grd.drwpoint[channel][0][0];
             dy=grd.drwpoint[channel][2][1]-grd.drwpoint[channel][0][1];
-            dxg=grd.drwpoint[channel][1][0]-grd.drwpoint[channel][0][0];
-            dyg=grd.drwpoint[channel][1][1]-grd.drwpoint[channel][0][1];
-            ga=log(double(dyg)/double(dy))/log(double(dxg)/double(dx));
+            ga=CalcGammaExponent(grd.drwpoint[channel]);
             sprintf(grd.gamma, "%.3lf", 1/ga);
             for (c1 = 0; c1 < dx+1; ++c1) {
                 grd.ovaluef(channel, c1+grd.drwpoint[channel][0][0], dy*(pow((double(c1)/dx),(ga)))+grd.drwpoint[channel][0][1]);
@@ -388,16 +425,103 @@ void CalcCurve(Gradation &grd, Channel channel)
         default:
             break;
     }
-    if (grd.drwpoint[channel][((grd.poic[channel])-1)][0] < 255) {
-        for (c2 = grd.drwpoint[channel][((grd.poic[channel])-1)][0]; c2 < 256; c2++) {
-            grd.ovalue(channel, c2, grd.drwpoint[channel][grd.poic[channel]-1][1]);
+    if (hi >= pt[n-1][0] && pt[n-1][0] < 255) {
+        for (c2 = pt[n-1][0]; c2 < 256; c2++) {
+            grd.ovalue(channel, c2, pt[n-1][1]);
         }
     }
-    for (i = 0; i < 256; ++i) {
+    for (i = lo; i <= hi; ++i) {
         InitRGBValues(grd, channel, i);
     }
 }
 
+class CurveShape
+// A curve as defined by its points, which can be evaluated at any x instead of
+// only at the 256 samples in the tables. Pen curves have no such definition,
+// and are interpolated from their samples.
+{
+    const Gradation &grd;
+    const Channel channel;
+    const DrawMode mode;
+    const int n;
+    const uint8_t (*pt)[2];
+    double a[maxPoints], b[maxPoints], c[maxPoints];
+    double ga;
+
+public:
+
+    CurveShape(const Gradation &aGrd, Channel aChannel) :
+        grd(aGrd), channel(aChannel), mode(aGrd.drwmode[aChannel]),
+        n(aGrd.poic[aChannel]), pt(aGrd.drwpoint[aChannel]), ga(1)
+    {
+        if (mode == DRAWMODE_SPLINE)
+            CalcSplineCoefficients(pt, n, a, b, c);
+        else if (mode == DRAWMODE_GAMMA)
+            ga = CalcGammaExponent(pt);
+    }
+
+    double operator()(double x) const
+    {
+        if (mode == DRAWMODE_PEN)
+            return interpolateCurveValue(grd.ovaluef(channel), x);
+        int last = mode == DRAWMODE_GAMMA ? 2 : n - 1;
+        if (x <= pt[0][0])
+            return pt[0][1];
+        if (x >= pt[last][0])
+            return pt[last][1];
+        if (mode == DRAWMODE_GAMMA)
+            return (pt[2][1]-pt[0][1])*pow((x-pt[0][0])/(pt[2][0]-pt[0][0]), ga)+pt[0][1];
+        int i = 0;
+        while (x > pt[i+1][0])
+            ++i;
+        if (mode == DRAWMODE_LINEAR)
+        {
+            double inc=(pt[i+1][1]-pt[i][1])/double(pt[i+1][0]-pt[i][0]);
+            return x*inc+(pt[i][1]-inc*pt[i][0]);
+        }
+        double t = x - pt[i][0];
+        return MIN(MAX(((a[i]*t+b[i])*t+c[i])*t+pt[i][1], 0.0), 255.0);
+    }
+};
+
+void CalcCurveSamples(const Gradation &grd, Channel channel, size_t count, float *samples)
+{
+    CurveShape curve(grd, channel);
+    for (size_t i = 0; i < count; ++i)
+        samples[i] = float(curve(255.0*i/(count - 1)));
+}
+
+void CalcRgbSamples(const Gradation &grd, Channel channel, size_t count, float *samples)
+{
+    CurveShape rgb(grd, CHANNEL_RGB);
+    CurveShape single(grd, channel);
+    bool full = grd.process == PROCMODE_FULL;
+    for (size_t i = 0; i < count; ++i)
+    {
+        double x = 255.0*i/(count - 1);
+        samples[i] = float(rgb(full ? single(x) : x));
+    }
+}
+
+bool GetLinearSegments(const Gradation &grd, Channel channel, LinearSegments &segments)
+{
+    const int n = grd.poic[channel];
+    const uint8_t (*pt)[2] = grd.drwpoint[channel];
+    bool linear = grd.drwmode[channel] == DRAWMODE_LINEAR || (grd.drwmode[channel] == DRAWMODE_SPLINE && n == 2);
+    if (!linear || n - 1 > maxLinearSegments)
+        return false;
+    bool identity = pt[0][0] == 0 && pt[n-1][0] == 255;
+    for (int i = 0; i < n; ++i)
+        identity = identity && pt[i][0] == pt[i][1];
+    segments.count = identity ? 0 : n - 1;
+    segments.y0 = pt[0][1];
+    for (int i = 0; i < n; ++i)
+        segments.x[i] = pt[i][0];
+    for (int i = 0; i < n - 1; ++i)
+        segments.slope[i] = (pt[i+1][1]-pt[i][1])/double(pt[i+1][0]-pt[i][0]);
+    return true;
+}
+
 static void PreCalcRgb2Lab(int *rgblab)
 {
     int kk[256];
@@ -459,147 +583,368 @@ static void PreCalcLab2Rgb(int *labrgb)
     }
 }
 
+// Read-only view of a whole file.
+class MappedFile
+{
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+    bool open_ = false;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = NULL;
+#endif
+
+public:
+
+    MappedFile(const char *filename)
+    {
+#ifdef _WIN32
+        file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        LARGE_INTEGER size;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size))
+            return;
+        open_ = true;
+        if (size.QuadPart == 0)
+            return;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping)
+            data_ = (const uint8_t *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        size_ = data_ ? size_t(size.QuadPart) : 0;
+        open_ = data_ != nullptr;
+#else
+        int fd = open(filename, O_RDONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0)
+        {
+            open_ = st.st_size == 0;
+            void *p = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+            if (p != MAP_FAILED)
+                data_ = (const uint8_t *) p,
+                size_ = st.st_size,
+                open_ = true;
+        }
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data_) munmap((void *) data_, size_);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool isOpen() const { return open_; }
+    const uint8_t *data() const { return data_; }
+    size_t size() const { return size_; }
+};
+
+// The precompiled format (.grdc) is a header followed by every field of the
+// Gradation structure except the precision, in the order in which they are
+// declared. Integers are little-endian, 'int' and enums are stored in 32 bits,
+// and doubles as their IEEE 754 binary64 bits, so that the files do not depend
+// on the padding or byte order of the build that wrote them. The version must
+// change along with the list of fields.
+static const char compiledCurvesMagic[4] = {'G', 'R', 'D', 'C'};
+enum
+{
+    compiledCurvesVersion = 2,
+    compiledCurvesHeaderSize = 24,
+    compiledCurvesPayloadSize = 4*(3*256 + 3*256 + 256) + 5*256 + 8*5*256 + 4 + 4*5 + 5*maxPoints*2 + 4*5 + 10,
+};
+
+static_assert(sizeof(double) == 8 && std::numeric_limits<double>::is_iec559, "The .grdc format needs IEEE 754 doubles");
+
+static uint64_t Fnv1a(const uint8_t *data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ data[i])*1099511628211ull;
+    return hash;
+}
+
+static uint8_t *PutLE(uint8_t *p, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+        *p++ = uint8_t(value >> 8*i);
+    return p;
+}
+
+static uint64_t GetLE(const uint8_t *&p, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i)
+        value |= uint64_t(*p++) << 8*i;
+    return value;
+}
+
+static void SerializeCurves(const Gradation &grd, uint8_t *p)
+{
+    for (auto &row : grd.rvalue)
+        for (int v : row)
+            p = PutLE(p, uint32_t(v), 4);
+    for (auto &row : grd.gvalue)
+        for (int v : row)
+            p = PutLE(p, uint32_t(v), 4);
+    for (int v : grd.bvalue)
+        p = PutLE(p, uint32_t(v), 4);
+    memcpy(p, grd._ovalue, sizeof(grd._ovalue));
+    p += sizeof(grd._ovalue);
+    for (auto &row : grd._ovaluef)
+        for (double v : row)
+        {
+            uint64_t bits;
+            memcpy(&bits, &v, 8);
+            p = PutLE(p, bits, 8);
+        }
+    p = PutLE(p, uint32_t(grd.process), 4);
+    for (DrawMode mode : grd.drwmode)
+        p = PutLE(p, uint32_t(mode), 4);
+    memcpy(p, grd.drwpoint, sizeof(grd.drwpoint));
+    p += sizeof(grd.drwpoint);
+    for (int count : grd.poic)
+        p = PutLE(p, uint32_t(count), 4);
+    memcpy(p, grd.gamma, sizeof(grd.gamma));
+}
+
+static bool DeserializeCurves(Gradation &grd, const uint8_t *p)
+// Returns false if an enum is out of range, or if the points of a channel
+// cannot be drawn: the curves need at least 2 points (3 for gamma) with
+// strictly increasing x, and read past the first and last ones otherwise.
+{
+    for (auto &row : grd.rvalue)
+        for (int &v : row)
+            v = int32_t(GetLE(p, 4));
+    for (auto &row : grd.gvalue)
+        for (int &v : row)
+            v = int32_t(GetLE(p, 4));
+    for (int &v : grd.bvalue)
+        v = int32_t(GetLE(p, 4));
+    memcpy(grd._ovalue, p, sizeof(grd._ovalue));
+    p += sizeof(grd._ovalue);
+    for (auto &row : grd._ovaluef)
+        for (double &v : row)
+        {
+            uint64_t bits = GetLE(p, 8);
+            memcpy(&v, &bits, 8);
+        }
+    uint32_t process = uint32_t(GetLE(p, 4));
+    if (process > PROCMODE_LAB)
+        return false;
+    grd.process = ProcessingMode(process);
+    for (DrawMode &mode : grd.drwmode)
+    {
+        uint32_t value = uint32_t(GetLE(p, 4));
+        if (value > DRAWMODE_GAMMA)
+            return false;
+        mode = DrawMode(value);
+    }
+    memcpy(grd.drwpoint, p, sizeof(grd.drwpoint));
+    p += sizeof(grd.drwpoint);
+    for (int c = 0; c < 5; ++c)
+    {
+        int count = int32_t(GetLE(p, 4));
+        if (count < (grd.drwmode[c] == DRAWMODE_GAMMA ? 3 : 2) || count > maxPoints)
+            return false;
+        for (int i = 1; i < count; ++i)
+            if (grd.drwpoint[c][i][0] <= grd.drwpoint[c][i-1][0])
+                return false;
+        grd.poic[c] = count;
+    }
+    memcpy(grd.gamma, p, sizeof(grd.gamma));
+    return true;
+}
+
+static bool ImportCompiledCurves(Gradation &grd, const uint8_t *data, size_t size)
+// Replaces all of 'grd' except the precision. The processing mode must be the
+// same, except that 'RGB only' and 'RGB + R/G/B' may be exchanged.
+{
+    if (size != compiledCurvesHeaderSize + compiledCurvesPayloadSize || memcmp(data, compiledCurvesMagic, 4) != 0)
+        return false;
+    const uint8_t *p = data + 4;
+    uint32_t version = uint32_t(GetLE(p, 4));
+    uint32_t payloadSize = uint32_t(GetLE(p, 4));
+    GetLE(p, 4); // Reserved.
+    uint64_t checksum = GetLE(p, 8);
+    if ( version != compiledCurvesVersion || payloadSize != compiledCurvesPayloadSize ||
+         checksum != Fnv1a(p, compiledCurvesPayloadSize) )
+        return false;
+    Gradation loaded = grd;
+    if (!DeserializeCurves(loaded, p))
+        return false;
+    bool rgb = (grd.process == PROCMODE_RGB || grd.process == PROCMODE_FULL) &&
+               (loaded.process == PROCMODE_RGB || loaded.process == PROCMODE_FULL);
+    if (loaded.process != grd.process && !rgb)
+        return false;
+    loaded.Labprecalc = 0; // The Lab tables of this process may not have been built yet.
+    grd = loaded;
+    return true;
+}
+
+static bool ExportCompiledCurves(const Gradation &grd, const char *filename)
+{
+    std::vector<uint8_t> data(compiledCurvesHeaderSize + compiledCurvesPayloadSize);
+    uint8_t *payload = data.data() + compiledCurvesHeaderSize;
+    SerializeCurves(grd, payload);
+    memcpy(data.data(), compiledCurvesMagic, 4);
+    uint8_t *p = PutLE(data.data() + 4, compiledCurvesVersion, 4);
+    p = PutLE(p, compiledCurvesPayloadSize, 4);
+    p = PutLE(p, 0, 4);
+    PutLE(p, Fnv1a(payload, compiledCurvesPayloadSize), 8);
+    FILE *pFile = fopen(filename, "wb");
+    if (pFile == NULL)
+        return false;
+    bool ok = fwrite(data.data(), data.size(), 1, pFile) == 1;
+    return fclose(pFile) == 0 && ok;
+}
+
+static bool ScanInt(const uint8_t *&p, const uint8_t *end, int &value)
+// Like fscanf("%d"): skips whitespace and reads a decimal integer. Returns
+// false if there is no integer at that position.
+{
+    while (p < end && (*p == ' ' || (*p >= '\t' && *p <= '\r')))
+        ++p;
+    const uint8_t *q = p;
+    bool negative = q < end && *q == '-';
+    if (q < end && (*q == '-' || *q == '+'))
+        ++q;
+    if (q == end || *q < '0' || *q > '9')
+        return false;
+    int v = 0;
+    for (; q < end && *q >= '0' && *q <= '9'; ++q)
+        v = v*10 + (*q - '0');
+    value = negative ? -v : v;
+    p = q;
+    return true;
+}
+
 bool ImportCurve(Gradation &grd, const char *filename, CurveFileType type, DrawMode defDrawMode)
 {
-    FILE *pFile;
+    MappedFile file(filename);
+    if (!file.isOpen())
+        return false;
+    return ImportCurveFromMemory(grd, file.data(), file.size(), type, defDrawMode);
+}
+
+bool ImportCurveFromMemory(Gradation &grd, const uint8_t *data, size_t size, CurveFileType type, DrawMode defDrawMode)
+{
     int i;
     int j;
-    int stor[1280];
-    int lSize;
+    int stor[1280] {0};
+    int lSize = int(MIN(size, size_t(0x7FFFFFFF)));
     int cv;
     bool nrf = false;
 
+    if (type == FILETYPE_GRDC)
+        return ImportCompiledCurves(grd, data, size);
+
     for (i=0;i<5;i++){grd.drwmode[i]=DRAWMODE_PEN;}
 
     if (type == FILETYPE_ACV)
     {
-        pFile = fopen(filename, "rb");
-        if (pFile==NULL) {return false;}
-        else
+        int noocur = 0;
+        int curpos = 0;
+        int cordpos = 7;
+        int curposnext = -1;
+        int cordcount = 0;
+        for(i=0; i < lSize; i++ ) //read the file and store the coordinates
         {
-            int noocur;
-            int curpos;
-            int cordpos = 7;
-            int curposnext = -1;
-            int cordcount = 0;
-            fseek (pFile , 0 , SEEK_END);
-            lSize = ftell (pFile);
-            rewind (pFile);
-            for(i=0; (i < lSize) && ( feof(pFile) == 0 ); i++ ) //read the file and store the coordinates
-            {
-                cv = fgetc(pFile);
-                if (i==3) { noocur = cv;
-                    if (noocur>5) {noocur=5;}
-                    curpos = 0;}
-                if (i==5) {grd.poic[curpos]=cv;
-                    if (noocur >= (curpos+1))
-                    {curposnext = i+grd.poic[curpos]*4+2;
-                    curpos++;}}
-                if (i==curposnext) {
-                    grd.poic[curpos] = cv;
-                    if (noocur >= (curpos+1))
-                    {curposnext = i+grd.poic[curpos]*4+2;
-                    if (grd.poic[curpos-1]>maxPoints) {grd.poic[curpos-1]=maxPoints;}
-                    curpos++;
-                    cordcount=0;
-                    cordpos=i+2;}}
-                if (i==cordpos) {
-                    grd.drwpoint[curpos-1][cordcount][1]=cv;}
-                if (i==(cordpos+2)) {
-                    grd.drwpoint[curpos-1][cordcount][0]=cv;
-                    if (cordcount<(maxPoints-1)) {cordcount++;}
-                    cordpos=cordpos+4;}
-            }
-            fclose (pFile);
-            if (noocur<5){ //fill empty curves if acv does contain less than 5 curves
-                for (i=noocur;i<5;i++)
-                    {grd.poic[i]=2;
-                    grd.drwpoint[i][0][0]=0;
-                    grd.drwpoint[i][0][1]=0;
-                    grd.drwpoint[i][1][0]=255;
-                    grd.drwpoint[i][1][1]=255;}
-                noocur=5;}
-            for (i=0;i<5;i++) { // calculate curve values
-                grd.drwmode[i]=defDrawMode;
-                CalcCurve(grd, Channel(i));
-            }
-            nrf=true;
+            cv = data[i];
+            if (i==3) { noocur = cv;
+                if (noocur>5) {noocur=5;}
+                curpos = 0;}
+            if (i==5) {grd.poic[curpos]=cv;
+                if (noocur >= (curpos+1))
+                {curposnext = i+grd.poic[curpos]*4+2;
+                curpos++;}}
+            if (i==curposnext) {
+                grd.poic[curpos] = cv;
+                if (noocur >= (curpos+1))
+                {curposnext = i+grd.poic[curpos]*4+2;
+                if (grd.poic[curpos-1]>maxPoints) {grd.poic[curpos-1]=maxPoints;}
+                curpos++;
+                cordcount=0;
+                cordpos=i+2;}}
+            if (i==cordpos) {
+                grd.drwpoint[curpos-1][cordcount][1]=cv;}
+            if (i==(cordpos+2)) {
+                grd.drwpoint[curpos-1][cordcount][0]=cv;
+                if (cordcount<(maxPoints-1)) {cordcount++;}
+                cordpos=cordpos+4;}
         }
-    }
-    if (type == FILETYPE_CSV) {
-        pFile = fopen(filename, "r");
-        if (pFile==NULL) {return false;}
-        else
-        {
-            fseek (pFile , 0 , SEEK_END);
-            lSize = ftell (pFile);
-            rewind (pFile);
-            for(i=0; (i < 1280) && ( feof(pFile) == 0 ); i++ )
-            {
-                if (fscanf(pFile, "%d", &stor[i]) != 1) {
-                    stor[i] = '\0';
-                }
-            }
-            fclose (pFile);
-            lSize = lSize/4;
+        if (noocur<5){ //fill empty curves if acv does contain less than 5 curves
+            for (i=noocur;i<5;i++)
+                {grd.poic[i]=2;
+                grd.drwpoint[i][0][0]=0;
+                grd.drwpoint[i][0][1]=0;
+                grd.drwpoint[i][1][0]=255;
+                grd.drwpoint[i][1][1]=255;}
+            noocur=5;}
+        for (i=0;i<5;i++) { // calculate curve values
+            grd.drwmode[i]=defDrawMode;
+            CalcCurve(grd, Channel(i));
         }
+        nrf=true;
+    }
+    else if (type == FILETYPE_CSV) {
+        const uint8_t *p = data, *end = data + size;
+        for(i=0; i < 1280 && ScanInt(p, end, stor[i]); i++ ) {}
+        lSize = lSize/4;
     }
     else if (type == FILETYPE_CRV || type == FILETYPE_MAP) {
-        pFile = fopen(filename, "rb");
-        if (pFile==NULL) {return false;}
-        else
+        int beg = (type == FILETYPE_CRV) ? 64 : 320;
+        int count = 0;
+        int curpos = -1;
+        int cordpos = beg+6;
+        int curposnext = 65530;
+        int cordcount = 0;
+        int gma = 1;
+        for(i=0; i < lSize; i++ )
         {
-            int beg = (type == FILETYPE_CRV) ? 64 : 320;
-            int count;
-            int curpos = -1;
-            int cordpos = beg+6;
-            int curposnext = 65530;
-            int cordcount;
-            int gma = 1;
-            fseek (pFile , 0 , SEEK_END);
-            lSize = ftell (pFile);
-            rewind (pFile);
-            for(i=0; (i < lSize) && ( feof(pFile) == 0 ); i++ )
-            {
-                cv = fgetc(pFile);
-                if (i == beg) {
-                    curpos++;
-                    grd.drwmode[curpos]=DrawMode(cv);
-                    curposnext = 65530;
-                    if (grd.drwmode[curpos] == DRAWMODE_PEN || grd.drwmode[curpos] == DRAWMODE_SPLINE) {
-                        grd.drwmode[curpos] = DrawMode(abs(grd.drwmode[curpos]-2));
-                    }
+            cv = data[i];
+            if (i == beg) {
+                curpos++;
+                grd.drwmode[curpos]=DrawMode(cv);
+                curposnext = 65530;
+                if (grd.drwmode[curpos] == DRAWMODE_PEN || grd.drwmode[curpos] == DRAWMODE_SPLINE) {
+                    grd.drwmode[curpos] = DrawMode(abs(grd.drwmode[curpos]-2));
                 }
-                if (i == beg+1 && grd.drwmode[curpos] == DRAWMODE_GAMMA) {gma=cv;}
-                if (i == beg+2 && grd.drwmode[curpos] == DRAWMODE_GAMMA) {gma=gma+(cv<<8);}
-                if (i == beg+5) {
-                    grd.poic[curpos]=cv;
-                    cordpos=i+1;
-                    curposnext = i+grd.poic[curpos]*2+1;
-                    if (curpos<4) {beg=i+grd.poic[curpos]*2+257;}
-                    cordcount=0;
-                    count=0;
-                    if (grd.poic[curpos]>maxPoints) {grd.poic[curpos]=maxPoints;}
-                }
-                if (i>=curposnext) { // read raw curve data
-                    cordpos=0;
-                    if (count<256) {grd.ovalue(curpos, count, cv);}
-                    count++;}
-                if (i == cordpos) {
-                    if (grd.drwmode[curpos] == DRAWMODE_GAMMA && cordcount==1) {
-                        if (gma>250) {grd.drwpoint[curpos][cordcount][0]=64;}
-                        else if (gma<50) {grd.drwpoint[curpos][cordcount][0]=192;}
-                        else {grd.drwpoint[curpos][cordcount][0]=128;}
-                        grd.drwpoint[curpos][cordcount][1]=int(pow(float(grd.drwpoint[curpos][cordcount][0])/256,100/float(gma))*256+0.5);
-                        cordcount++;
-                        grd.poic[curpos]++;}
-                    grd.drwpoint[curpos][cordcount][0]=cv;}
-                if (i == cordpos+1) {
-                    grd.drwpoint[curpos][cordcount][1]=cv;
-                    if (cordcount<grd.poic[curpos]-1 && cordcount<maxPoints-1) {cordcount++;}
-                    cordpos=cordpos+2;}
             }
-            fclose (pFile);
+            if (i == beg+1 && grd.drwmode[curpos] == DRAWMODE_GAMMA) {gma=cv;}
+            if (i == beg+2 && grd.drwmode[curpos] == DRAWMODE_GAMMA) {gma=gma+(cv<<8);}
+            if (i == beg+5) {
+                grd.poic[curpos]=cv;
+                cordpos=i+1;
+                curposnext = i+grd.poic[curpos]*2+1;
+                if (curpos<4) {beg=i+grd.poic[curpos]*2+257;}
+                cordcount=0;
+                count=0;
+                if (grd.poic[curpos]>maxPoints) {grd.poic[curpos]=maxPoints;}
+            }
+            if (i>=curposnext) { // read raw curve data
+                cordpos=0;
+                if (count<256) {grd.ovalue(curpos, count, cv);}
+                count++;}
+            if (i == cordpos) {
+                if (grd.drwmode[curpos] == DRAWMODE_GAMMA && cordcount==1) {
+                    if (gma>250) {grd.drwpoint[curpos][cordcount][0]=64;}
+                    else if (gma<50) {grd.drwpoint[curpos][cordcount][0]=192;}
+                    else {grd.drwpoint[curpos][cordcount][0]=128;}
+                    grd.drwpoint[curpos][cordcount][1]=int(pow(float(grd.drwpoint[curpos][cordcount][0])/256,100/float(gma))*256+0.5);
+                    cordcount++;
+                    grd.poic[curpos]++;}
+                grd.drwpoint[curpos][cordcount][0]=cv;}
+            if (i == cordpos+1) {
+                grd.drwpoint[curpos][cordcount][1]=cv;
+                if (cordcount<grd.poic[curpos]-1 && cordcount<maxPoints-1) {cordcount++;}
+                cordpos=cordpos+2;}
         }
         if (type == FILETYPE_MAP) { //*.map exchange 4<->0
             int temp[1280];
@@ -635,40 +980,22 @@ bool ImportCurve(Gradation &grd, const char *filename, CurveFileType type, DrawM
     }
     else if (type == FILETYPE_SMARTCURVE_HSV)
     {
-        pFile = fopen(filename, "rb");
-        if (pFile==NULL) {return false;}
-        else
+        for(i=0; i < MIN(lSize, 768); i++ )
         {
-            fseek (pFile , 0 , SEEK_END);
-            lSize = ftell (pFile);
-            rewind (pFile);
-            for(i=0; (i < 768) && ( feof(pFile) == 0 ); i++ )
-            {
-                if (i<256)
-                {stor[i+512] = fgetc(pFile);}
-                if (i>255 && i <512)
-                {stor[i] = fgetc(pFile);}
-                if (i>511)
-                {stor[i-512] = fgetc(pFile);}
-            }
-            fclose (pFile);
-            lSize = 768;
+            if (i<256)
+            {stor[i+512] = data[i];}
+            if (i>255 && i <512)
+            {stor[i] = data[i];}
+            if (i>511)
+            {stor[i-512] = data[i];}
         }
+        lSize = 768;
     }
     else // FILETYPE_AMP
     {
-        pFile = fopen(filename, "rb");
-        if (pFile==NULL) {return false;}
-        else
+        for(i=0; i < MIN(lSize, 1280); i++ )
         {
-            fseek (pFile , 0 , SEEK_END);
-            lSize = ftell (pFile);
-            rewind (pFile);
-            for(i=0; (i < 1280) && ( feof(pFile) == 0 ); i++ )
-            {
-                stor[i] = fgetc(pFile);
-            }
-            fclose (pFile);
+            stor[i] = data[i];
         }
     }
     if (nrf==false) { //fill curves for non coordinates file types
@@ -725,14 +1052,21 @@ bool ImportCurve(Gradation &grd, const char *filename, CurveFileType type, DrawM
     return true;
 }
 
-void ExportCurve(const Gradation &grd, const char *filename, CurveFileType type)
+bool ExportCurve(const Gradation &grd, const char *filename, CurveFileType type)
+// FILETYPE_GRDC stores the curves exactly as they are in memory, including the
+// effect of ApplyLevels, ApplyStrength and ComposeCurves and the floating-point
+// tables. The other types only store the points or the 8-bit tables.
 {
     FILE *pFile;
     int i;
     int j;
 
+    if (type == FILETYPE_GRDC)
+        return ExportCompiledCurves(grd, filename);
+
     if (type == FILETYPE_ACV) {
         pFile = fopen(filename,"wb");
+        if (pFile==NULL) {return false;}
         fputc(0, pFile);
         fputc(4, pFile);
         fputc(0, pFile);
@@ -750,6 +1084,7 @@ void ExportCurve(const Gradation &grd, const char *filename, CurveFileType type)
     }
     else if (type == FILETYPE_CSV) {
         pFile = fopen(filename,"w");
+        if (pFile==NULL) {return false;}
         for (j=0; j<5;j++) {
             for (i=0; i<256; i++) {
                 fprintf(pFile, "%d\n", grd.ovalue(j, i));
@@ -758,13 +1093,14 @@ void ExportCurve(const Gradation &grd, const char *filename, CurveFileType type)
     }
     else { // FILETYPE_AMP
         pFile = fopen(filename,"wb");
+        if (pFile==NULL) {return false;}
         for (j=0; j<5;j++) {
             for (i=0; i<256; i++) {
                 fputc(grd.ovalue(j, i), pFile);
             }
         }
     }
-    fclose(pFile);
+    return fclose(pFile) == 0;
 }
 
 void ImportPoints(Gradation &grd, Channel channel, const uint8_t points[][2], size_t count, DrawMode drawMode)
@@ -782,6 +1118,159 @@ void ImportPoints(Gradation &grd, Channel channel, const uint8_t points[][2], si
     }
 }
 
+static inline bool IsPerChannelRgb(ProcessingMode process)
+{
+    return process == PROCMODE_RGB || process == PROCMODE_FULL;
+}
+
+static inline uint8_t applyPerChannelRgb(const Gradation &grd, int channel, uint8_t x)
+{
+    return grd.ovalue(0, grd.process == PROCMODE_FULL ? grd.ovalue(channel, x) : x);
+}
+
+static inline double applyPerChannelRgb(const Gradation &grd, int channel, double x)
+{
+    if (grd.process == PROCMODE_FULL)
+        x = interpolateCurveValue(grd.ovaluef(channel), x);
+    return interpolateCurveValue(grd.ovaluef(0), x);
+}
+
+static void ResetPoints(Gradation &grd, int channel)
+{
+    grd.drwmode[channel] = DRAWMODE_PEN;
+    grd.poic[channel] = 2;
+    grd.drwpoint[channel][0][0] = 0;
+    grd.drwpoint[channel][0][1] = 0;
+    grd.drwpoint[channel][1][0] = 255;
+    grd.drwpoint[channel][1][1] = 255;
+}
+
+static void SetPerChannelRgb(Gradation &grd)
+// Pre: the R/G/B curves hold the whole transformation of each channel.
+{
+    for (int x = 0; x < 256; ++x)
+        grd.ovalue(CHANNEL_RGB, x, x);
+    grd.process = PROCMODE_FULL;
+    for (int c = CHANNEL_RGB; c <= CHANNEL_BLUE; ++c)
+    {
+        ResetPoints(grd, c);
+        for (int x = 0; x < 256; ++x)
+            InitRGBValues(grd, Channel(c), x);
+    }
+}
+
+bool ComposeCurves(Gradation &grd, const Gradation &first)
+// Turns 'grd' into the equivalent of processing with 'first' and then with 'grd'.
+// Only the RGB and RGB + R/G/B modes can be combined, since their result is
+// the same when their tables are composed. The other modes convert back to RGB
+// and clamp between both steps, or derive K again in CMYK. Returns false if the
+// modes cannot be combined.
+{
+    const Gradation second = grd;
+    if (IsPerChannelRgb(grd.process) && IsPerChannelRgb(first.process))
+    {
+        for (int c = CHANNEL_RED; c <= CHANNEL_BLUE; ++c)
+            for (int x = 0; x < 256; ++x)
+            {
+                grd._ovalue[c][x] = applyPerChannelRgb(second, c, applyPerChannelRgb(first, c, uint8_t(x)));
+                grd._ovaluef[c][x] = applyPerChannelRgb(second, c, applyPerChannelRgb(first, c, double(x)));
+            }
+        SetPerChannelRgb(grd);
+        return true;
+    }
+    return false;
+}
+
+bool ApplyStrength(Gradation &grd, double strength)
+// Blends the output of the RGB and RGB + R/G/B modes with their input, so that
+// out = in + strength*(curve(in) - in). Returns false for any other mode.
+{
+    if (!IsPerChannelRgb(grd.process))
+        return false;
+    const Gradation original = grd;
+    for (int c = CHANNEL_RED; c <= CHANNEL_BLUE; ++c)
+        for (int x = 0; x < 256; ++x)
+        {
+            int v = applyPerChannelRgb(original, c, uint8_t(x));
+            double vf = applyPerChannelRgb(original, c, double(x));
+            grd._ovalue[c][x] = uint8_t(MIN(MAX(x + strength*(v - x) + 0.5, 0.0), 255.0));
+            grd._ovaluef[c][x] = MIN(MAX(x + strength*(vf - x), 0.0), 255.0);
+        }
+    SetPerChannelRgb(grd);
+    return true;
+}
+
+static inline double applyInputLevels(const Levels &levels, double x)
+{
+    double v = (x - levels.black)/(levels.white - levels.black);
+    return 255*pow(MIN(MAX(v, 0.0), 1.0), 1/levels.gamma);
+}
+
+static inline double applyOutputLevels(const Levels &levels, double y)
+{
+    return levels.black + pow(y/255, 1/levels.gamma)*(levels.white - levels.black);
+}
+
+bool ApplyLevels(Gradation &grd, const Levels &input, const Levels &output)
+// Folds input and output levels into the curves of the RGB and RGB + R/G/B
+// modes. Returns false for any other mode.
+{
+    if (!IsPerChannelRgb(grd.process))
+        return false;
+    Gradation pre, post;
+    Init(pre, grd.precise);
+    Init(post, grd.precise);
+    for (int x = 0; x < 256; ++x)
+    {
+        pre.ovaluef(CHANNEL_RGB, x, applyInputLevels(input, x));
+        post.ovaluef(CHANNEL_RGB, x, applyOutputLevels(output, x));
+    }
+    ComposeCurves(grd, pre);
+    ComposeCurves(post, grd);
+    grd = post;
+    return true;
+}
+
+size_t MakeAutoPoints(const double histogram[256], AutoCurveMethod method, double percentile, double limit, uint8_t points[][2])
+// Derives points for a curve from a histogram of its input. 'Levels' maps the
+// darkest and brightest values present to black and white, 'stretch' does the
+// same after ignoring a fraction 'percentile' of the values at each end, and
+// 'equalize' follows the cumulative distribution, blended with the identity by
+// 'limit'. Returns the number of points written, at most maxPoints.
+{
+    double cdf[256];
+    double total = 0;
+    for (int i = 0; i < 256; ++i)
+        cdf[i] = total += histogram[i];
+    size_t count = 0;
+    if (total > 0 && method == AUTOCURVE_EQUALIZE)
+    {
+        for (int x = 0; ; x = MIN(x + 16, 255))
+        {
+            double y = x + limit*(255*(cdf[x] - histogram[x]/2)/total - x);
+            points[count][0] = uint8_t(x);
+            points[count][1] = uint8_t(MIN(MAX(y + 0.5, 0.0), 255.0));
+            ++count;
+            if (x == 255)
+                break;
+        }
+        return count;
+    }
+    double cut = method == AUTOCURVE_STRETCH ? percentile*total : 0;
+    int black = 0, white = 255;
+    while (black < 255 && cdf[black] <= cut)
+        ++black;
+    while (white > 0 && total - cdf[white - 1] <= cut)
+        --white;
+    if (total <= 0 || black >= white)
+        black = 0, white = 255;
+    points[0][0] = uint8_t(black);
+    points[0][1] = 0;
+    points[1][0] = uint8_t(white);
+    points[1][1] = 255;
+    return 2;
+}
+
 static inline double interpolateCurveValue(const double y[256], double x)
 {
     // Interpolate from two points.
@@ -791,6 +1280,17 @@ static inline double interpolateCurveValue(const double y[256], double x)
     return y[x1] + ff*(y[x2] - y[x1]);
 }
 
+static void interpolateCurveValues(const double y[256], float *v, size_t count)
+// Same as interpolateCurveValue for each of 'v', which must be in [0, 255].
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        int x1 = MIN(int(v[i]), 254);
+        float ff = v[i] - x1;
+        v[i] = float(y[x1] + ff*(y[x1 + 1] - y[x1]));
+    }
+}
+
 RGB<uint8_t> procModeRgb::processInt(const Gradation &grd, uint8_t r, uint8_t g, uint8_t b)
 {
     return unpackRGB(
@@ -837,6 +1337,221 @@ RGB<double> procModeFull::processDouble(const Gradation &grd, double r, double g
     };
 }
 
+static inline RGB<uint8_t> processWeightedInt(const Gradation &grd, uint32_t pixel)
+// Moves all components by the change which the RGB curve applies to their
+// weighted average.
+{
+    int r = (pixel & 0xFF0000);
+    int g = (pixel & 0x00FF00);
+    int b = (pixel & 0x0000FF);
+    int bw = int((77 * (r >> 16) + 150 * (g >> 8) + 29 * b)>>8);
+    r = r+grd.rvalue[2][bw];
+    if (r<65536) r=0; else if (r>16711680) r=16711680;
+    g = g+grd.gvalue[2][bw];
+    if (g<256) g=0; else if (g>65280) g=65280;
+    b = b+grd.bvalue[bw];
+    if (b<0) b=0; else if (b>255) b=255;
+    return unpackRGB(r+g+b);
+}
+
+static inline RGB<double> processWeightedDouble(const Gradation &grd, double r, double g, double b)
+{
+    double bw = (77*r + 150*g + 29*b)/256;
+    double delta = interpolateCurveValue(grd.ovaluef(0), bw) - bw;
+    return {
+        MIN(MAX(r + delta, 0.0), 255.0),
+        MIN(MAX(g + delta, 0.0), 255.0),
+        MIN(MAX(b + delta, 0.0), 255.0),
+    };
+}
+
+RGB<uint8_t> procModeRgbw::processInt(const Gradation &grd, uint8_t r, uint8_t g, uint8_t b)
+{
+    return processWeightedInt(grd, packRGB({r, g, b}));
+}
+
+RGB<double> procModeRgbw::processDouble(const Gradation &grd, double r, double g, double b)
+{
+    return processWeightedDouble(grd, r, g, b);
+}
+
+RGB<uint8_t> procModeFullw::processInt(const Gradation &grd, uint8_t r, uint8_t g, uint8_t b)
+{
+    uint32_t med = grd.rvalue[1][r] + grd.gvalue[1][g] + grd.ovalue(3, b);
+    return processWeightedInt(grd, med);
+}
+
+RGB<double> procModeFullw::processDouble(const Gradation &grd, double r, double g, double b)
+{
+    return processWeightedDouble(grd,
+        interpolateCurveValue(grd.ovaluef(1), r),
+        interpolateCurveValue(grd.ovaluef(2), g),
+        interpolateCurveValue(grd.ovaluef(3), b)
+    );
+}
+
+RGB<uint8_t> procModeCmyk::processInt(const Gradation &grd, uint8_t r8, uint8_t g8, uint8_t b8)
+{
+    int r = r8, g = g8, b = b8;
+    int v, div, divh, x, y, z;
+    if(r>=g && r>=b) { /* r is Maximum */
+        v = 255-r;
+        div  = r+1;
+        divh = div>>1;
+        x = 0;
+        y = (((r-g)<<8) + divh)/div;  //correct rounding  yy+(div>>1)
+        z = (((r-b)<<8) + divh)/div;} //correct rounding  zz+(div>>1)
+    else if(g>=b) {/* g is maximum */
+        v = 255-g;
+        div  = g+1;
+        divh = div>>1;
+        x = (((g-r)<<8) + divh)/div;  //correct rounding  xx+(div>>1)
+        y = 0;
+        z = (((g-b)<<8) + divh)/div;} //correct rounding  zz+(div>>1)
+    else {/* b is maximum */
+        v = 255-b;
+        div  = b+1;
+        divh = div>>1;
+        x = (((b-r)<<8) + divh)/div; //correct rounding  xx+(div>>1)
+        y = (((b-g)<<8) + divh)/div; //correct rounding  yy+(div>>1)
+        z = 0;}
+    // Applying the curves
+    x = grd.ovalue(1, x);
+    y = grd.ovalue(2, y);
+    z = grd.ovalue(3, z);
+    v = grd.ovalue(4, v);
+    // CMYK to RGB
+    r = 255-((((x*(256-v))+128)>>8)+v); //correct rounding rr+128;
+    if (r<0) r=0;
+    g = 255-((((y*(256-v))+128)>>8)+v); //correct rounding gg+128;
+    if (g<0) g=0;
+    b = 255-((((z*(256-v))+128)>>8)+v); //correct rounding bb+128;
+    if (b<0) b=0;
+    return {uint8_t(r), uint8_t(g), uint8_t(b)};
+}
+
+RGB<double> procModeCmyk::processDouble(const Gradation &grd, double r, double g, double b)
+{
+    auto cmyk = rgb2cmyk(r, g, b);
+    auto rgb = cmyk2rgb(
+        interpolateCurveValue(grd.ovaluef(1), cmyk.c),
+        interpolateCurveValue(grd.ovaluef(2), cmyk.m),
+        interpolateCurveValue(grd.ovaluef(3), cmyk.y),
+        interpolateCurveValue(grd.ovaluef(4), cmyk.k)
+    );
+    return rgb;
+}
+
+// Same model as the integer version: black is taken from the brightest
+// component, and C, M and Y are relative to it.
+static CMYK<double> rgb2cmyk(double r, double g, double b)
+{
+    double max = MAX(MAX(r, g), b);
+    if (max <= 0.0)
+        return {0, 0, 0, 255};
+    return {
+        (max - r)*255/max,
+        (max - g)*255/max,
+        (max - b)*255/max,
+        255 - max,
+    };
+}
+
+static RGB<double> cmyk2rgb(double c, double m, double y, double k)
+{
+    double w = 255 - k;
+    return {
+        MIN(MAX((255 - c)*w/255, 0.0), 255.0),
+        MIN(MAX((255 - m)*w/255, 0.0), 255.0),
+        MIN(MAX((255 - y)*w/255, 0.0), 255.0),
+    };
+}
+
+RGB<uint8_t> procModeLab::processInt(const Gradation &grd, uint8_t r, uint8_t g, uint8_t b)
+{
+    int lab = rgblab[packRGB({r, g, b})];
+    // Applying the curves
+    int x = grd.ovalue(1, (lab & 0xFF0000)>>16);
+    int y = grd.ovalue(2, (lab & 0x00FF00)>>8);
+    int z = grd.ovalue(3, (lab & 0x0000FF));
+    //Lab to RGB
+    return unpackRGB(labrgb[((x<<16)+(y<<8)+z)]);
+}
+
+RGB<double> procModeLab::processDouble(const Gradation &grd, double r, double g, double b)
+{
+    auto lab = rgb2lab(r, g, b);
+    auto rgb = lab2rgb(
+        interpolateCurveValue(grd.ovaluef(1), lab.l),
+        interpolateCurveValue(grd.ovaluef(2), lab.a),
+        interpolateCurveValue(grd.ovaluef(3), lab.b)
+    );
+    return rgb;
+}
+
+// CIE L*a*b* of sRGB (D65), scaled to [0, 255] the same way as the tables of
+// the integer version.
+namespace CIELab
+{
+constexpr auto lScale = 2.55;
+constexpr auto aScale = 1.38272635, aOffset = 119.167434;
+constexpr auto bScale = 1.26023769, bOffset = 135.936123;
+constexpr auto xn = 0.9505, zn = 1.089; // White point of the matrix below.
+constexpr auto delta = 6.0/29;
+}
+
+static inline double srgbToLinear(double v)
+{
+    v /= 255;
+    return v <= 0.04045 ? v/12.92 : pow((v + 0.055)/1.055, 2.4);
+}
+
+static inline double linearToSrgb(double v)
+{
+    v = v <= 0.0031308 ? v*12.92 : 1.055*pow(v, 1/2.4) - 0.055;
+    return MIN(MAX(v*255, 0.0), 255.0);
+}
+
+static inline double labF(double t)
+{
+    using namespace CIELab;
+    return t > delta*delta*delta ? cbrt(t) : t/(3*delta*delta) + 4.0/29;
+}
+
+static inline double labFInverse(double f)
+{
+    using namespace CIELab;
+    return f > delta ? f*f*f : 3*delta*delta*(f - 4.0/29);
+}
+
+static LAB<double> rgb2lab(double r, double g, double b)
+{
+    using namespace CIELab;
+    double lr = srgbToLinear(r), lg = srgbToLinear(g), lb = srgbToLinear(b);
+    double fx = labF((0.4124*lr + 0.3576*lg + 0.1805*lb)/xn);
+    double fy = labF(0.2126*lr + 0.7152*lg + 0.0722*lb);
+    double fz = labF((0.0193*lr + 0.1192*lg + 0.9505*lb)/zn);
+    return {
+        MIN(MAX((116*fy - 16)*lScale, 0.0), 255.0),
+        MIN(MAX(500*(fx - fy)*aScale + aOffset, 0.0), 255.0),
+        MIN(MAX(200*(fy - fz)*bScale + bOffset, 0.0), 255.0),
+    };
+}
+
+static RGB<double> lab2rgb(double l, double a, double b)
+{
+    using namespace CIELab;
+    double fy = (l/lScale + 16)/116;
+    double fx = fy + (a - aOffset)/aScale/500;
+    double fz = fy - (b - bOffset)/bScale/200;
+    double x = labFInverse(fx)*xn, y = labFInverse(fy), z = labFInverse(fz)*zn;
+    return {
+        linearToSrgb( 3.240625477320*x - 1.537207972210*y - 0.498628598698*z),
+        linearToSrgb(-0.968930714729*x + 1.875756060885*y + 0.041517523843*z),
+        linearToSrgb( 0.055710120446*x - 0.204021050598*y + 1.056995942254*z),
+    };
+}
+
 RGB<uint8_t> procModeHsv::processInt(const Gradation &grd, uint8_t r, uint8_t g, uint8_t b)
 {
     // RGB to HSV
@@ -919,6 +1634,49 @@ RGB<double> procModeHsv::processDouble(const Gradation &grd, double r, double g,
     return rgb;
 }
 
+// The single-precision versions work on whole rows, in passes without
+// branches so that the conversions are vectorized. Only the curves are
+// looked up one sample at a time.
+void procModeHsv::processFloat(const Gradation &grd, float *r, float *g, float *b, size_t count)
+{
+    // RGB to HSV, in place.
+    for (size_t i = 0; i < count; ++i)
+    {
+        float max = MAX(MAX(r[i], g[i]), b[i]);
+        float min = MIN(MIN(r[i], g[i]), b[i]);
+        float delta = max - min;
+        float inv = 42.5f/MAX(delta, 1e-20f); // When delta is 0, r[i] == max and h is 0.
+        float h = r[i] == max ? (g[i] - b[i])*inv
+                : g[i] == max ? 85.0f + (b[i] - r[i])*inv
+                :               170.0f + (r[i] - g[i])*inv;
+        float s = delta*255.0f/MAX(max, 1e-20f);
+        r[i] = h < 0.0f ? h + 255.0f : h;
+        g[i] = s;
+        b[i] = max;
+    }
+    interpolateCurveValues(grd.ovaluef(1), r, count);
+    interpolateCurveValues(grd.ovaluef(2), g, count);
+    interpolateCurveValues(grd.ovaluef(3), b, count);
+    // HSV to RGB, in place, with the same result as the sectors of hsv2rgb:
+    // each component is v*(1 - s*clamp(min(k, 4 - k), 0, 1)), where k is
+    // (n + hh) mod 6 and n is 5, 3 and 1 for R, G and B.
+    for (size_t i = 0; i < count; ++i)
+    {
+        float hh = r[i]*(1/42.5f);
+        hh = hh < 6.0f ? hh : 0.0f;
+        float vs = b[i]*g[i]*(1/255.0f), v = b[i];
+        float k[3] = {5.0f + hh, 3.0f + hh, 1.0f + hh};
+        for (float &kk : k)
+        {
+            kk = kk < 6.0f ? kk : kk - 6.0f;
+            kk = MIN(MAX(MIN(kk, 4.0f - kk), 0.0f), 1.0f);
+        }
+        r[i] = v - vs*k[0];
+        g[i] = v - vs*k[1];
+        b[i] = v - vs*k[2];
+    }
+}
+
 // https://stackoverflow.com/a/6930407
 static HSV<double> rgb2hsv(double r, double g, double b)
 {
@@ -1017,6 +1775,35 @@ constexpr auto dCB = 1.772;
 constexpr auto dCR = 1.402;
 }
 
+void procModeYuv::processFloat(const Gradation &grd, float *r, float *g, float *b, size_t count)
+{
+    using namespace BT601;
+    // RGB to YUV, in place.
+    for (size_t i = 0; i < count; ++i)
+    {
+        float y = float(mR)*r[i] + float(mG)*g[i] + float(mB)*b[i];
+        float u = 128.0f + (b[i] - y)*float(1/dCB);
+        float v = 128.0f + (r[i] - y)*float(1/dCR);
+        r[i] = MIN(MAX(y, 0.0f), 255.0f);
+        g[i] = MIN(MAX(u, 0.0f), 255.0f);
+        b[i] = MIN(MAX(v, 0.0f), 255.0f);
+    }
+    interpolateCurveValues(grd.ovaluef(1), r, count);
+    interpolateCurveValues(grd.ovaluef(2), g, count);
+    interpolateCurveValues(grd.ovaluef(3), b, count);
+    // YUV to RGB, in place.
+    for (size_t i = 0; i < count; ++i)
+    {
+        float y = r[i], u = g[i] - 128.0f, v = b[i] - 128.0f;
+        float rr = y + float(dCR)*v;
+        float gg = y - float(mB*dCB/mG)*u - float(mR*dCR/mG)*v;
+        float bb = y + float(dCB)*u;
+        r[i] = MIN(MAX(rr, 0.0f), 255.0f);
+        g[i] = MIN(MAX(gg, 0.0f), 255.0f);
+        b[i] = MIN(MAX(bb, 0.0f), 255.0f);
+    }
+}
+
 static YUV<double> rgb2yuv(double r, double g, double b)
 {
     using namespace BT601;
@@ -117,10 +117,23 @@ enum CurveFileType {
     FILETYPE_CRV = 4,
     FILETYPE_MAP = 5,
     FILETYPE_SMARTCURVE_HSV = 6,
+    FILETYPE_GRDC = 7, // Precompiled curves, see ExportCurve.
+};
+
+enum AutoCurveMethod {
+    AUTOCURVE_LEVELS    = 0,
+    AUTOCURVE_STRETCH   = 1,
+    AUTOCURVE_EQUALIZE  = 2,
 };
 
 enum { maxPoints = 32 };
 
+// Black point, white point and gamma, in the [0, 255] range.
+struct Levels
+{
+    double black, white, gamma;
+};
+
 struct Gradation {
     int rvalue[3][256];
     int gvalue[3][256];
@@ -156,14 +169,69 @@ struct Gradation {
     }
 };
 
+// Results of the YUV, CMYK and HSV modes for recently seen colours, indexed by a
+// hash of the 24-bit input, and counts of how often they were reused. Only
+// valid for one Gradation; each thread needs its own.
+struct PixelCache
+{
+    enum { bits = 12, size = 1 << bits };
+    static const uint32_t empty = 0xFFFFFFFFU; // Never a 24-bit colour.
+
+    uint32_t keys[size];
+    uint32_t values[size];
+    uint64_t pixels, hits, runs; // 'runs' counts pixels equal to the previous one.
+
+    PixelCache() :
+        values {0}
+    {
+        clear();
+    }
+
+    // Forgets every colour, to be used with other curves.
+    void clear()
+    {
+        for (auto &key : keys)
+            key = empty;
+        pixels = hits = runs = 0;
+    }
+};
+
 void Init(Gradation &grd, bool precise = false);
-void Run(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uint32_t *dst, int32_t src_pitch, int32_t dst_pitch);
+void Run(const Gradation &grd, int32_t width, int32_t height, uint32_t *src, uint32_t *dst, int32_t src_pitch, int32_t dst_pitch, PixelCache *cache = nullptr);
 
 void PreCalcLut(Gradation &grd);
-void CalcCurve(Gradation &grd, Channel channel);
+void CalcCurve(Gradation &grd, Channel channel, int firstPoint = 0, int lastPoint = maxPoints - 1);
+// Sample the curve of 'channel' at 'count' evenly spaced inputs over [0, 255],
+// evaluated from its points rather than interpolated from the 256 samples in
+// the tables. Samples are in the [0, 255] range.
+void CalcCurveSamples(const Gradation &grd, Channel channel, size_t count, float *samples);
+// Same for the whole transformation of R, G or B in the RGB and RGB + R/G/B modes.
+void CalcRgbSamples(const Gradation &grd, Channel channel, size_t count, float *samples);
+
+enum { maxLinearSegments = 3 };
+
+// A linear curve with few segments, which is cheaper to evaluate as
+// y = y0 + sum(slope[i]*(clamp(x, x[i], x[i + 1]) - x[i])) than by
+// interpolating its samples. The identity has no segments.
+struct LinearSegments
+{
+    int count;
+    double y0;
+    double x[maxLinearSegments + 1];
+    double slope[maxLinearSegments];
+};
+
+// Returns false if the curve of 'channel' is not such a curve.
+bool GetLinearSegments(const Gradation &grd, Channel channel, LinearSegments &segments);
+
 bool ImportCurve(Gradation &grd, const char *filename, CurveFileType type, DrawMode defDrawMode = DRAWMODE_SPLINE);
-void ExportCurve(const Gradation &grd, const char *filename, CurveFileType type);
+bool ImportCurveFromMemory(Gradation &grd, const uint8_t *data, size_t size, CurveFileType type, DrawMode defDrawMode = DRAWMODE_SPLINE);
+bool ExportCurve(const Gradation &grd, const char *filename, CurveFileType type);
 void ImportPoints(Gradation &grd, Channel channel, const uint8_t points[][2], size_t count, DrawMode drawMode);
+bool ComposeCurves(Gradation &grd, const Gradation &first);
+bool ApplyLevels(Gradation &grd, const Levels &input, const Levels &output);
+bool ApplyStrength(Gradation &grd, double strength);
+size_t MakeAutoPoints(const double histogram[256], AutoCurveMethod method, double percentile, double limit, uint8_t points[][2]);
 
 inline void InitRGBValues(Gradation &grd, Channel channel, int x) {
     uint8_t val = grd.ovalue(channel, x);
@@ -246,7 +314,34 @@ struct procModeFull
     static RGB<double> processDouble(const Gradation &grd, double r, double g, double b);
 };
 
+struct procModeRgbw
+{
+    static RGB<uint8_t> processInt(const Gradation &grd, uint8_t r, uint8_t g, uint8_t b);
+    static RGB<double> processDouble(const Gradation &grd, double r, double g, double b);
+};
+
+struct procModeFullw
+{
+    static RGB<uint8_t> processInt(const Gradation &grd, uint8_t r, uint8_t g, uint8_t b);
+    static RGB<double> processDouble(const Gradation &grd, double r, double g, double b);
+};
+
 struct procModeYuv
+{
+    static RGB<uint8_t> processInt(const Gradation &grd, uint8_t r, uint8_t g, uint8_t b);
+    static RGB<double> processDouble(const Gradation &grd, double r, double g, double b);
+    // Single-precision version of processDouble for 'count' pixels in the
+    // [0, 255] range, in place. See README.md for its accuracy.
+    static void processFloat(const Gradation &grd, float *r, float *g, float *b, size_t count);
+};
+
+struct procModeCmyk
+{
+    static RGB<uint8_t> processInt(const Gradation &grd, uint8_t r, uint8_t g, uint8_t b);
+    static RGB<double> processDouble(const Gradation &grd, double r, double g, double b);
+};
+
+struct procModeLab
 {
     static RGB<uint8_t> processInt(const Gradation &grd, uint8_t r, uint8_t g, uint8_t b);
     static RGB<double> processDouble(const Gradation &grd, double r, double g, double b);
@@ -256,6 +351,9 @@ struct procModeHsv
 {
     static RGB<uint8_t> processInt(const Gradation &grd, uint8_t r, uint8_t g, uint8_t b);
     static RGB<double> processDouble(const Gradation &grd, double r, double g, double b);
+    // Single-precision version of processDouble for 'count' pixels in the
+    // [0, 255] range, in place. See README.md for its accuracy.
+    static void processFloat(const Gradation &grd, float *r, float *g, float *b, size_t count);
 };
 
 #endif // GRADATION_MAIN_H
@@ -542,7 +542,7 @@ static DLGPROC_RET CALLBACK ConfigDlgProc(HWND hdlg, UINT msg, WPARAM wParam, LP
                         else {mfd->drwpoint[mfd->channel_mode][mfd->cp][0]=ax;}
                     }
                     }
-                CalcCurve(*mfd, mfd->channel_mode);
+                CalcCurve(*mfd, mfd->channel_mode, mfd->cp, mfd->cp);
                 if (mfd->drwmode[mfd->channel_mode]==DRAWMODE_GAMMA){
                     hWnd = GetDlgItem(hdlg, IDC_GAMMAVALUE);
                     SetWindowText(hWnd, mfd->gamma);}
@@ -685,7 +685,7 @@ static DLGPROC_RET CALLBACK ConfigDlgProc(HWND hdlg, UINT msg, WPARAM wParam, LP
                 ofn.hwndOwner = hdlg;
                 ofn.hInstance = NULL;
                 ofn.lpTemplateName = NULL;
-                ofn.lpstrFilter = "Map Settings (*.amp)\0*.amp\0Adjustment Curves (*.acv)\0*.acv\0Comma Separated Values (*.csv)\0*.csv\0Tone Curve File (*.crv)\0*.crv\0Tone Map File (*.map)\0*.map\0SmartCurve HSV (*.amp)\0*.amp\0\0";
+                ofn.lpstrFilter = "Map Settings (*.amp)\0*.amp\0Adjustment Curves (*.acv)\0*.acv\0Comma Separated Values (*.csv)\0*.csv\0Tone Curve File (*.crv)\0*.crv\0Tone Map File (*.map)\0*.map\0SmartCurve HSV (*.amp)\0*.amp\0Precompiled Curves (*.grdc)\0*.grdc\0\0";
                 ofn.lpstrCustomFilter = NULL;
                 ofn.nMaxCustFilter = 0;
                 ofn.nFilterIndex = 1;
@@ -0,0 +1,735 @@
+#include "avisynth.mock.h"
+
+#include <new>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// VideoInfo
+
+bool VideoInfo::IsRGB() const
+{
+    return (pixel_type & CS_BGR) != 0;
+}
+
+bool VideoInfo::IsRGB32() const
+{
+    return (pixel_type & CS_BGR32) == CS_BGR32 && (pixel_type & CS_Sample_Bits_Mask) == CS_Sample_Bits_8;
+}
+
+bool VideoInfo::IsYUV() const
+{
+    return (pixel_type & CS_YUV) != 0;
+}
+
+bool VideoInfo::IsYUVA() const
+{
+    return (pixel_type & CS_YUVA) != 0;
+}
+
+bool VideoInfo::IsPlanar() const
+{
+    return (pixel_type & CS_PLANAR) != 0;
+}
+
+bool VideoInfo::Is444() const
+{
+    int type = pixel_type & CS_PLANAR_MASK & ~CS_Sample_Bits_Mask;
+    return type == (CS_GENERIC_YUV444 & CS_PLANAR_FILTER) || type == (CS_GENERIC_YUVA444 & CS_PLANAR_FILTER);
+}
+
+int VideoInfo::BitsPerComponent() const
+{
+    switch (pixel_type & CS_Sample_Bits_Mask)
+    {
+        case CS_Sample_Bits_10: return 10;
+        case CS_Sample_Bits_12: return 12;
+        case CS_Sample_Bits_14: return 14;
+        case CS_Sample_Bits_16: return 16;
+        case CS_Sample_Bits_32: return 32;
+        default: return 8;
+    }
+}
+
+// VideoFrameBuffer and VideoFrame
+
+VideoFrameBuffer::VideoFrameBuffer(int size, int, Device *) :
+    data(new BYTE[size]()), data_size(size), sequence_number(0), refcount(1), device(nullptr)
+{
+}
+
+VideoFrameBuffer::~VideoFrameBuffer()
+{
+    delete[] data;
+}
+
+VideoFrame::VideoFrame( VideoFrameBuffer *_vfb, AVSMap *avsmap, int _offset, int _pitch, int _row_size, int _height,
+                        int _offsetU, int _offsetV, int _pitchUV, int _row_sizeUV, int _heightUV, int _offsetA ) :
+    refcount(0), vfb(_vfb), offset(_offset), pitch(_pitch), row_size(_row_size), height(_height),
+    offsetU(_offsetU), offsetV(_offsetV), pitchUV(_pitchUV), row_sizeUV(_row_sizeUV), heightUV(_heightUV),
+    offsetA(_offsetA), pitchA(_offsetA ? _pitch : 0), row_sizeA(_offsetA ? _row_size : 0), properties(avsmap)
+{
+}
+
+VideoFrame::~VideoFrame()
+{
+    delete properties;
+    delete vfb;
+}
+
+void *VideoFrame::operator new(size_t size)
+{
+    return ::operator new(size);
+}
+
+void VideoFrame::AddRef()
+{
+    ++refcount;
+}
+
+void VideoFrame::Release()
+{
+    if (--refcount == 0)
+        delete this;
+}
+
+int VideoFrame::GetPitch(int plane) const
+{
+    switch (plane)
+    {
+        case PLANAR_U: case PLANAR_V: case PLANAR_B: case PLANAR_R: return pitchUV;
+        case PLANAR_A: return pitchA;
+        default: return pitch;
+    }
+}
+
+int VideoFrame::GetHeight(int plane) const
+{
+    return plane == PLANAR_A || plane == 0 || plane == PLANAR_Y || plane == PLANAR_G ? height : heightUV ? heightUV : height;
+}
+
+const BYTE *VideoFrame::GetReadPtr(int plane) const
+{
+    switch (plane)
+    {
+        case PLANAR_U: case PLANAR_B: return vfb->data + offsetU;
+        case PLANAR_V: case PLANAR_R: return vfb->data + offsetV;
+        case PLANAR_A: return vfb->data + offsetA;
+        default: return vfb->data + offset;
+    }
+}
+
+BYTE *VideoFrame::GetWritePtr(int plane) const
+{
+    return const_cast<BYTE *>(GetReadPtr(plane));
+}
+
+bool VideoFrame::IsWritable() const
+{
+    return refcount == 1;
+}
+
+// PVideoFrame
+
+PVideoFrame::PVideoFrame() :
+    p(nullptr)
+{
+}
+
+PVideoFrame::PVideoFrame(const PVideoFrame &x) :
+    p(nullptr)
+{
+    Set(x.p);
+}
+
+PVideoFrame::PVideoFrame(VideoFrame *x) :
+    p(nullptr)
+{
+    Set(x);
+}
+
+void PVideoFrame::operator=(VideoFrame *x)
+{
+    Set(x);
+}
+
+void PVideoFrame::operator=(const PVideoFrame &x)
+{
+    Set(x.p);
+}
+
+PVideoFrame::~PVideoFrame()
+{
+    Set(nullptr);
+}
+
+void PVideoFrame::Set(VideoFrame *x)
+{
+    if (x)
+        x->AddRef();
+    if (p)
+        p->Release();
+    p = x;
+}
+
+// IClip and PClip
+
+void IClip::AddRef()
+{
+    ++refcnt;
+}
+
+void IClip::Release()
+{
+    if (--refcnt == 0)
+        delete this;
+}
+
+PClip::PClip() :
+    p(nullptr)
+{
+}
+
+PClip::PClip(const PClip &x) :
+    p(nullptr)
+{
+    Set(x.p);
+}
+
+PClip::PClip(IClip *x) :
+    p(nullptr)
+{
+    Set(x);
+}
+
+void PClip::operator=(IClip *x)
+{
+    Set(x);
+}
+
+void PClip::operator=(const PClip &x)
+{
+    Set(x.p);
+}
+
+PClip::~PClip()
+{
+    Set(nullptr);
+}
+
+void PClip::Set(IClip *x)
+{
+    if (x)
+        x->AddRef();
+    if (p)
+        p->Release();
+    p = x;
+}
+
+// AVSValue
+
+AVSValue::AVSValue() :
+    type('v'), array_size(0), clip(nullptr)
+{
+}
+
+AVSValue::AVSValue(IClip *c) :
+    type('c'), array_size(0), clip(c)
+{
+    if (c)
+        c->AddRef();
+}
+
+AVSValue::AVSValue(const PClip &c) :
+    AVSValue(c.operator->())
+{
+}
+
+AVSValue::AVSValue(bool b) :
+    type('b'), array_size(0), clip(nullptr)
+{
+    boolean = b;
+}
+
+AVSValue::AVSValue(int i) :
+    type('i'), array_size(0), clip(nullptr)
+{
+    integer = i;
+}
+
+AVSValue::AVSValue(float f) :
+    type('f'), array_size(0), clip(nullptr)
+{
+    floating_pt = f;
+}
+
+AVSValue::AVSValue(double f) :
+    AVSValue(float(f))
+{
+}
+
+AVSValue::AVSValue(const char *s) :
+    type('s'), array_size(0), clip(nullptr)
+{
+    string = s;
+}
+
+AVSValue::AVSValue(const AVSValue *a, int size) :
+    type('v'), array_size(0), clip(nullptr)
+{
+    AVSValue src;
+    src.type = 'a';
+    src.array_size = short(size);
+    src.array = a;
+    Assign(&src, true);
+    src.type = 'v'; // The elements are not owned by 'src'.
+}
+
+AVSValue::AVSValue(const AVSValue &v) :
+    type('v'), array_size(0), clip(nullptr)
+{
+    Assign(&v, true);
+}
+
+AVSValue::~AVSValue()
+{
+    Assign(nullptr, false);
+}
+
+AVSValue &AVSValue::operator=(const AVSValue &v)
+{
+    if (this != &v)
+        Assign(&v, false);
+    return *this;
+}
+
+void AVSValue::Assign(const AVSValue *src, bool init)
+// Copies 'src', or clears the value if it is null. Arrays are copied deeply.
+{
+    short oldType = init ? 'v' : type;
+    IClip *oldClip = clip;
+    const AVSValue *oldArray = array;
+    type = 'v';
+    array_size = 0;
+    clip = nullptr;
+    if (src && src->type == 'a')
+    {
+        AVSValue *elems = new AVSValue[src->array_size ? src->array_size : 1];
+        for (int i = 0; i < src->array_size; ++i)
+            elems[i] = src->array[i];
+        type = 'a';
+        array_size = src->array_size;
+        array = elems;
+    }
+    else if (src)
+    {
+        memcpy((void *) this, (const void *) src, sizeof(*this));
+        if (type == 'c' && clip)
+            clip->AddRef();
+    }
+    if (oldType == 'a')
+        delete[] oldArray;
+    else if (oldType == 'c' && oldClip)
+        oldClip->Release();
+}
+
+bool AVSValue::Defined() const { return type != 'v'; }
+bool AVSValue::IsClip() const { return type == 'c'; }
+bool AVSValue::IsBool() const { return type == 'b'; }
+bool AVSValue::IsInt() const { return type == 'i'; }
+bool AVSValue::IsFloat() const { return type == 'f' || type == 'i'; }
+bool AVSValue::IsString() const { return type == 's'; }
+bool AVSValue::IsArray() const { return type == 'a'; }
+
+PClip AVSValue::AsClip() const { return IsClip() ? clip : nullptr; }
+bool AVSValue::AsBool() const { return boolean; }
+int AVSValue::AsInt() const { return integer; }
+const char *AVSValue::AsString() const { return IsString() ? string : nullptr; }
+double AVSValue::AsFloat() const { return type == 'i' ? integer : floating_pt; }
+bool AVSValue::AsBool(bool def) const { return IsBool() ? boolean : def; }
+int AVSValue::AsInt(int def) const { return IsInt() ? integer : def; }
+double AVSValue::AsFloat(float def) const { return IsFloat() ? AsFloat() : def; }
+const char *AVSValue::AsString(const char *def) const { return IsString() ? string : def; }
+int AVSValue::ArraySize() const { return IsArray() ? array_size : 1; }
+const AVSValue &AVSValue::operator[](int index) const { return IsArray() ? array[index] : *this; }
+
+// ScriptEnvironment
+
+ScriptEnvironment::ScriptEnvironment()
+{
+}
+
+PClip ScriptEnvironment::invoke(const char *name, const PClip &clip, const std::vector<std::pair<const char *, AVSValue>> &args)
+{
+    auto it = functions.find(name);
+    if (it == functions.end())
+        ThrowError("Unknown function '%s'", name);
+    // Each argument of the signature is an optional "[name]" followed by its type.
+    std::vector<std::string> names;
+    const std::string &params = it->second.params;
+    for (size_t i = 0; i < params.size(); ++i)
+    {
+        std::string argName;
+        if (params[i] == '[')
+        {
+            size_t end = params.find(']', i);
+            argName = params.substr(i + 1, end - i - 1);
+            i = end + 1;
+        }
+        while (i + 1 < params.size() && (params[i + 1] == '*' || params[i + 1] == '+'))
+            ++i;
+        names.push_back(argName);
+    }
+    std::vector<AVSValue> values(names.size());
+    values[0] = clip;
+    for (auto &arg : args)
+    {
+        size_t i = 1;
+        while (i < names.size() && names[i] != arg.first)
+            ++i;
+        if (i == names.size())
+            ThrowError("%s does not have a named argument \"%s\"", name, arg.first);
+        values[i] = arg.second;
+    }
+    AVSValue result = it->second.apply(AVSValue(values.data(), int(values.size())), it->second.userData, this);
+    return result.AsClip();
+}
+
+int __stdcall ScriptEnvironment::GetCPUFlags() { return 0; }
+
+char *__stdcall ScriptEnvironment::SaveString(const char *s, int length)
+{
+    strings.emplace_back(s, length < 0 ? strlen(s) : size_t(length));
+    return &strings.back()[0];
+}
+
+char *ScriptEnvironment::Sprintf(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    char *result = VSprintf(fmt, args);
+    va_end(args);
+    return result;
+}
+
+char *__stdcall ScriptEnvironment::VSprintf(const char *fmt, va_list val)
+{
+    char buffer[4096];
+    vsnprintf(buffer, sizeof(buffer), fmt, val);
+    return SaveString(buffer);
+}
+
+void ScriptEnvironment::ThrowError(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    char *message = VSprintf(fmt, args);
+    va_end(args);
+    throw AvisynthError(message);
+}
+
+void __stdcall ScriptEnvironment::AddFunction(const char *name, const char *params, ApplyFunc apply, void *user_data)
+{
+    functions[name] = {params, apply, user_data};
+}
+
+bool __stdcall ScriptEnvironment::FunctionExists(const char *name)
+{
+    return functions.count(name) != 0;
+}
+
+AVSValue __stdcall ScriptEnvironment::GetVar(const char *name)
+{
+    auto it = vars.find(name);
+    if (it == vars.end())
+        throw NotFound();
+    return it->second;
+}
+
+bool __stdcall ScriptEnvironment::SetVar(const char *name, const AVSValue &val)
+{
+    vars[name] = val;
+    return true;
+}
+
+bool __stdcall ScriptEnvironment::SetGlobalVar(const char *name, const AVSValue &val)
+{
+    return SetVar(name, val);
+}
+
+AVSValue __stdcall ScriptEnvironment::GetVarDef(const char *name, const AVSValue &def)
+{
+    auto it = vars.find(name);
+    return it != vars.end() ? it->second : def;
+}
+
+bool __stdcall ScriptEnvironment::GetVarTry(const char *name, AVSValue *val) const
+{
+    auto it = vars.find(name);
+    if (it == vars.end())
+        return false;
+    *val = it->second;
+    return true;
+}
+
+PVideoFrame __stdcall ScriptEnvironment::NewVideoFrame(const VideoInfo &vi, int)
+{
+    auto align = [] (int size) { return (size + 63) & ~63; };
+    int sampleSize = vi.BitsPerComponent() == 8 ? 1 : vi.BitsPerComponent() == 32 ? 4 : 2;
+    bool isY = (vi.pixel_type & VideoInfo::CS_PLANAR_MASK & ~VideoInfo::CS_Sample_Bits_Mask) == VideoInfo::CS_GENERIC_Y;
+    bool hasAlpha = vi.IsYUVA() || (vi.IsPlanar() && vi.IsRGB() && (vi.pixel_type & VideoInfo::CS_RGBA_TYPE));
+    // VideoFrame declares no operator delete, so the frame is allocated with
+    // the global operator new that matches the delete in Release().
+    void *memory = ::operator new(sizeof(VideoFrame));
+    VideoFrame *frame;
+    if (!vi.IsPlanar())
+    {
+        int rowSize = vi.width*sampleSize*(vi.pixel_type & VideoInfo::CS_RGBA_TYPE ? 4 : 3);
+        int pitch = align(rowSize);
+        frame = ::new (memory) VideoFrame(new VideoFrameBuffer(pitch*vi.height, 0, nullptr), new AVSMap, 0, pitch, rowSize, vi.height,
+                               0, 0, 0, 0, 0, 0);
+    }
+    else
+    {
+        int rowSize = vi.width*sampleSize;
+        int pitch = align(rowSize);
+        int planeSize = pitch*vi.height;
+        int planeCount = isY ? 1 : 3 + hasAlpha;
+        frame = ::new (memory) VideoFrame(new VideoFrameBuffer(planeSize*planeCount, 0, nullptr), new AVSMap, 0, pitch, rowSize, vi.height,
+                               isY ? 0 : planeSize, isY ? 0 : 2*planeSize, isY ? 0 : pitch, isY ? 0 : rowSize, isY ? 0 : vi.height,
+                               hasAlpha ? 3*planeSize : 0);
+    }
+    return frame;
+}
+
+PVideoFrame __stdcall ScriptEnvironment::NewVideoFrameP(const VideoInfo &vi, PVideoFrame *propSrc, int align)
+{
+    PVideoFrame frame = NewVideoFrame(vi, align);
+    if (propSrc && *propSrc)
+        copyFrameProps(*propSrc, frame);
+    return frame;
+}
+
+void __stdcall ScriptEnvironment::copyFrameProps(const PVideoFrame &src, PVideoFrame &dst)
+{
+    *dst->properties = *src->properties;
+}
+
+const AVSMap *__stdcall ScriptEnvironment::getFramePropsRO(const PVideoFrame &frame)
+{
+    return frame->properties;
+}
+
+AVSMap *__stdcall ScriptEnvironment::getFramePropsRW(PVideoFrame &frame)
+{
+    return frame->properties;
+}
+
+int __stdcall ScriptEnvironment::propNumKeys(const AVSMap *map)
+{
+    return int(map->ints.size() + map->floats.size() + map->data.size());
+}
+
+int __stdcall ScriptEnvironment::propNumElements(const AVSMap *map, const char *key)
+{
+    if (map->ints.count(key))
+        return int(map->ints.at(key).size());
+    if (map->floats.count(key))
+        return int(map->floats.at(key).size());
+    return map->data.count(key) ? 1 : -1;
+}
+
+char __stdcall ScriptEnvironment::propGetType(const AVSMap *map, const char *key)
+{
+    return map->ints.count(key) ? PROPTYPE_INT : map->floats.count(key) ? PROPTYPE_FLOAT
+         : map->data.count(key) ? PROPTYPE_DATA : PROPTYPE_UNSET;
+}
+
+int64_t __stdcall ScriptEnvironment::propGetInt(const AVSMap *map, const char *key, int index, int *error)
+{
+    auto it = map->ints.find(key);
+    int err = it == map->ints.end() ? GETPROPERROR_UNSET : index >= int(it->second.size()) ? GETPROPERROR_INDEX : 0;
+    if (error)
+        *error = err;
+    return err ? 0 : it->second[index];
+}
+
+double __stdcall ScriptEnvironment::propGetFloat(const AVSMap *map, const char *key, int index, int *error)
+{
+    auto it = map->floats.find(key);
+    int err = it == map->floats.end() ? GETPROPERROR_UNSET : index >= int(it->second.size()) ? GETPROPERROR_INDEX : 0;
+    if (error)
+        *error = err;
+    return err ? 0 : it->second[index];
+}
+
+const char *__stdcall ScriptEnvironment::propGetData(const AVSMap *map, const char *key, int index, int *error)
+{
+    auto it = map->data.find(key);
+    int err = it == map->data.end() ? GETPROPERROR_UNSET : index > 0 ? GETPROPERROR_INDEX : 0;
+    if (error)
+        *error = err;
+    return err ? nullptr : it->second.c_str();
+}
+
+int __stdcall ScriptEnvironment::propGetDataSize(const AVSMap *map, const char *key, int index, int *error)
+{
+    const char *data = propGetData(map, key, index, error);
+    return data ? int(map->data.at(key).size()) : -1;
+}
+
+const int64_t *__stdcall ScriptEnvironment::propGetIntArray(const AVSMap *map, const char *key, int *error)
+{
+    propGetInt(map, key, 0, error);
+    auto it = map->ints.find(key);
+    return it != map->ints.end() ? it->second.data() : nullptr;
+}
+
+const double *__stdcall ScriptEnvironment::propGetFloatArray(const AVSMap *map, const char *key, int *error)
+{
+    propGetFloat(map, key, 0, error);
+    auto it = map->floats.find(key);
+    return it != map->floats.end() ? it->second.data() : nullptr;
+}
+
+int __stdcall ScriptEnvironment::propDeleteKey(AVSMap *map, const char *key)
+{
+    return int(map->ints.erase(key) + map->floats.erase(key) + map->data.erase(key));
+}
+
+int __stdcall ScriptEnvironment::propSetInt(AVSMap *map, const char *key, int64_t i, int append)
+{
+    if (append != PROPAPPENDMODE_APPEND)
+        propDeleteKey(map, key);
+    map->ints[key].push_back(i);
+    return 0;
+}
+
+int __stdcall ScriptEnvironment::propSetFloat(AVSMap *map, const char *key, double d, int append)
+{
+    if (append != PROPAPPENDMODE_APPEND)
+        propDeleteKey(map, key);
+    map->floats[key].push_back(d);
+    return 0;
+}
+
+int __stdcall ScriptEnvironment::propSetData(AVSMap *map, const char *key, const char *d, int length, int)
+{
+    propDeleteKey(map, key);
+    map->data[key].assign(d, length < 0 ? strlen(d) : size_t(length));
+    return 0;
+}
+
+int __stdcall ScriptEnvironment::propSetIntArray(AVSMap *map, const char *key, const int64_t *i, int size)
+{
+    propDeleteKey(map, key);
+    map->ints[key].assign(i, i + size);
+    return 0;
+}
+
+int __stdcall ScriptEnvironment::propSetFloatArray(AVSMap *map, const char *key, const double *d, int size)
+{
+    propDeleteKey(map, key);
+    map->floats[key].assign(d, d + size);
+    return 0;
+}
+
+AVSMap *__stdcall ScriptEnvironment::createMap() { return new AVSMap; }
+void __stdcall ScriptEnvironment::freeMap(AVSMap *map) { delete map; }
+void __stdcall ScriptEnvironment::clearMap(AVSMap *map) { *map = AVSMap(); }
+
+// The rest of the interface is not used by the plugin.
+
+static void unsupported(const char *name)
+{
+    fprintf(stderr, "ScriptEnvironment::%s is not supported by the mock\n", name);
+    abort();
+}
+
+AVSValue __stdcall ScriptEnvironment::Invoke(const char *, const AVSValue, const char * const *) { unsupported("Invoke"); return {}; }
+void __stdcall ScriptEnvironment::PushContext(int) { unsupported("PushContext"); }
+void __stdcall ScriptEnvironment::PopContext() { unsupported("PopContext"); }
+bool __stdcall ScriptEnvironment::MakeWritable(PVideoFrame *) { unsupported("MakeWritable"); return false; }
+void __stdcall ScriptEnvironment::BitBlt(BYTE *, int, const BYTE *, int, int, int) { unsupported("BitBlt"); }
+void __stdcall ScriptEnvironment::AtExit(ShutdownFunc, void *) { unsupported("AtExit"); }
+void __stdcall ScriptEnvironment::CheckVersion(int) {}
+PVideoFrame __stdcall ScriptEnvironment::Subframe(PVideoFrame, int, int, int, int) { unsupported("Subframe"); return {}; }
+int __stdcall ScriptEnvironment::SetMemoryMax(int) { return 0; }
+int __stdcall ScriptEnvironment::SetWorkingDir(const char *) { unsupported("SetWorkingDir"); return 0; }
+void *__stdcall ScriptEnvironment::ManageCache(int, void *) { unsupported("ManageCache"); return nullptr; }
+bool __stdcall ScriptEnvironment::PlanarChromaAlignment(PlanarChromaAlignmentMode) { return false; }
+PVideoFrame __stdcall ScriptEnvironment::SubframePlanar(PVideoFrame, int, int, int, int, int, int, int) { unsupported("SubframePlanar"); return {}; }
+void __stdcall ScriptEnvironment::DeleteScriptEnvironment() { unsupported("DeleteScriptEnvironment"); }
+void __stdcall ScriptEnvironment::ApplyMessage(PVideoFrame *, const VideoInfo &, const char *, int, int, int, int) { unsupported("ApplyMessage"); }
+const AVS_Linkage *__stdcall ScriptEnvironment::GetAVSLinkage() { return nullptr; }
+PVideoFrame __stdcall ScriptEnvironment::SubframePlanarA(PVideoFrame, int, int, int, int, int, int, int, int) { unsupported("SubframePlanarA"); return {}; }
+const char *__stdcall ScriptEnvironment::propGetKey(const AVSMap *, int) { unsupported("propGetKey"); return nullptr; }
+PClip __stdcall ScriptEnvironment::propGetClip(const AVSMap *, const char *, int, int *) { unsupported("propGetClip"); return {}; }
+const PVideoFrame __stdcall ScriptEnvironment::propGetFrame(const AVSMap *, const char *, int, int *) { unsupported("propGetFrame"); return {}; }
+int __stdcall ScriptEnvironment::propSetClip(AVSMap *, const char *, PClip &, int) { unsupported("propSetClip"); return 0; }
+int __stdcall ScriptEnvironment::propSetFrame(AVSMap *, const char *, const PVideoFrame &, int) { unsupported("propSetFrame"); return 0; }
+size_t __stdcall ScriptEnvironment::GetEnvProperty(AvsEnvProperty) { return 0; }
+void *__stdcall ScriptEnvironment::Allocate(size_t, size_t, AvsAllocType) { unsupported("Allocate"); return nullptr; }
+void __stdcall ScriptEnvironment::Free(void *) { unsupported("Free"); }
+bool __stdcall ScriptEnvironment::GetVarBool(const char *, bool) const { unsupported("GetVarBool"); return false; }
+int __stdcall ScriptEnvironment::GetVarInt(const char *, int) const { unsupported("GetVarInt"); return 0; }
+double __stdcall ScriptEnvironment::GetVarDouble(const char *, double) const { unsupported("GetVarDouble"); return 0; }
+const char *__stdcall ScriptEnvironment::GetVarString(const char *, const char *) const { unsupported("GetVarString"); return nullptr; }
+int64_t __stdcall ScriptEnvironment::GetVarLong(const char *, int64_t) const { unsupported("GetVarLong"); return 0; }
+bool __stdcall ScriptEnvironment::InvokeTry(AVSValue *, const char *, const AVSValue &, const char * const *) { unsupported("InvokeTry"); return false; }
+AVSValue __stdcall ScriptEnvironment::Invoke2(const AVSValue &, const char *, const AVSValue, const char * const *) { unsupported("Invoke2"); return {}; }
+bool __stdcall ScriptEnvironment::Invoke2Try(AVSValue *, const AVSValue &, const char *, const AVSValue, const char * const *) { unsupported("Invoke2Try"); return false; }
+AVSValue __stdcall ScriptEnvironment::Invoke3(const AVSValue &, const PFunction &, const AVSValue, const char * const *) { unsupported("Invoke3"); return {}; }
+bool __stdcall ScriptEnvironment::Invoke3Try(AVSValue *, const AVSValue &, const PFunction &, const AVSValue, const char * const *) { unsupported("Invoke3Try"); return false; }
+bool __stdcall ScriptEnvironment::MakePropertyWritable(PVideoFrame *) { unsupported("MakePropertyWritable"); return false; }
+
+// TestClip
+
+TestClip::TestClip(ScriptEnvironment &env, int pixelType, int width, int height, int frameCount) :
+    vi(),
+    requests(0)
+{
+    vi.width = width;
+    vi.height = height;
+    vi.fps_numerator = 25;
+    vi.fps_denominator = 1;
+    vi.num_frames = frameCount;
+    vi.pixel_type = pixelType;
+    for (int n = 0; n < frameCount; ++n)
+        frames.push_back(env.NewVideoFrame(vi));
+}
+
+// parseArray
+
+static AVSValue parseValue(const char *&p)
+{
+    while (*p == ' ')
+        ++p;
+    if (*p != '[')
+    {
+        char *end;
+        double v = strtod(p, &end);
+        bool isFloat = memchr(p, '.', end - p) != nullptr;
+        p = end;
+        return isFloat ? AVSValue(v) : AVSValue(int(v));
+    }
+    std::vector<AVSValue> elems;
+    ++p;
+    while (*p == ' ')
+        ++p;
+    while (*p != ']')
+    {
+        elems.push_back(parseValue(p));
+        while (*p == ' ' || *p == ',')
+            ++p;
+    }
+    ++p;
+    return AVSValue(elems.data(), int(elems.size()));
+}
+
+AVSValue parseArray(const char *text)
+{
+    const char *p = text;
+    return parseValue(p);
+}
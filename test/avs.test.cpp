@@ -0,0 +1,670 @@
+#include "test.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "avisynth.mock.h"
+
+extern "C" const char *__stdcall AvisynthPluginInit3(IScriptEnvironment *env, AVS_Linkage *vectors);
+
+// Creates Gradation() filters on clips held in memory, and reads the frames
+// they produce.
+class GradationFilterTest : public ::testing::Test
+{
+protected:
+
+    ScriptEnvironment env;
+
+    GradationFilterTest()
+    {
+        AvisynthPluginInit3(&env, nullptr);
+    }
+
+    // Clip whose pixels are set by 'fill(frame number, frame)'.
+    TestClip *makeClip(int pixelType, int width, int height, int frameCount,
+                       const std::function<void(int, const PVideoFrame &)> &fill)
+    {
+        auto *clip = new TestClip(env, pixelType, width, height, frameCount);
+        for (int n = 0; n < frameCount; ++n)
+            fill(n, clip->frames[n]);
+        return clip;
+    }
+
+    PClip gradation(const PClip &clip, const std::vector<std::pair<const char *, AVSValue>> &args)
+    {
+        return env.invoke("Gradation", clip, args);
+    }
+
+    // Pixel (x, y) of an RGB32 frame, as {B, G, R, A}. Rows are stored bottom-up.
+    static BYTE *rgb32(const PVideoFrame &frame, int x, int y)
+    {
+        int height = frame->GetHeight();
+        return frame->GetWritePtr() + (height - 1 - y)*frame->GetPitch() + 4*x;
+    }
+
+    // Writes an AMP file whose RGB curve maps every value to 'value'.
+    static void writeConstantCurve(const char *filename, int value)
+    {
+        FILE *file = fopen(filename, "wb");
+        ASSERT_NE(file, nullptr);
+        for (int i = 0; i < 256; ++i)
+            fputc(value, file);
+        fclose(file);
+    }
+
+    // Sample (x, y) of an 8-bit planar frame.
+    static BYTE &sample(const PVideoFrame &frame, int plane, int x, int y)
+    {
+        return frame->GetWritePtr(plane)[y*frame->GetPitch(plane) + x];
+    }
+};
+
+TEST_F(GradationFilterTest, ShouldProcessYuv444InRgb)
+{
+    // Inverting the RGB curve mirrors limited-range luma around 125.5 and
+    // chroma around 128.
+    PClip clip = makeClip(VideoInfo::CS_YV24, 16, 8, 1, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+            {
+                sample(frame, PLANAR_Y, x, y) = BYTE(60 + 8*x + y);
+                sample(frame, PLANAR_U, x, y) = BYTE(124 + y);
+                sample(frame, PLANAR_V, x, y) = BYTE(132 - y);
+            }
+    });
+    PClip out = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"points", parseArray("[[[0, 255], [255, 0]]]")}});
+    ASSERT_EQ(out->GetVideoInfo().pixel_type, VideoInfo::CS_YV24);
+    PVideoFrame frame = out->GetFrame(0, &env);
+    for (int y = 0; y < 8; ++y)
+        for (int x = 0; x < 16; ++x)
+        {
+            EXPECT_NEAR(sample(frame, PLANAR_Y, x, y), 251 - (60 + 8*x + y), 1) << "At " << x << ", " << y;
+            EXPECT_NEAR(sample(frame, PLANAR_U, x, y), 256 - (124 + y), 1) << "At " << x << ", " << y;
+            EXPECT_NEAR(sample(frame, PLANAR_V, x, y), 256 - (132 - y), 1) << "At " << x << ", " << y;
+        }
+}
+
+TEST_F(GradationFilterTest, ShouldRejectSubsampledYuv)
+{
+    PClip clip = makeClip(VideoInfo::CS_YV12, 16, 8, 1, [] (int, const PVideoFrame &) {});
+    EXPECT_THROW(gradation(clip, {{"process", "rgb"}, {"points", parseArray("[[[0, 255], [255, 0]]]")}}), AvisynthError);
+}
+
+TEST_F(GradationFilterTest, ShouldBlendAnimatedStrengthOnRgb32)
+{
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 16, 8, 3, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+            {
+                BYTE *p = rgb32(frame, x, y);
+                p[0] = BYTE(16*x), p[1] = BYTE(32*y), p[2] = BYTE(255 - 16*x), p[3] = BYTE(x + y);
+            }
+    });
+    PClip out = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"points", parseArray("[[[0, 255], [255, 0]]]")},
+                                 {"strength", parseArray("[[0, 0.0], [2, 1.0]]")}});
+    ASSERT_EQ(out->GetVideoInfo().pixel_type, VideoInfo::CS_BGR32);
+    for (int n = 0; n < 3; ++n)
+    {
+        PVideoFrame src = clip->GetFrame(n, &env), dst = out->GetFrame(n, &env);
+        double strength = n/2.0;
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+            {
+                const BYTE *in = rgb32(src, x, y), *p = rgb32(dst, x, y);
+                for (int c = 0; c < 3; ++c)
+                    EXPECT_NEAR(p[c], in[c] + strength*(255 - 2*in[c]), 0.5) << "At " << x << ", " << y << " in frame " << n;
+                EXPECT_EQ(p[3], in[3]);
+            }
+    }
+}
+
+TEST_F(GradationFilterTest, ShouldBlendConstantStrengthInKernelOnRgb32)
+{
+    // The HSV mode cannot fold the strength into its curves.
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 16, 8, 1, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+                memset(rgb32(frame, x, y), 16*x + y, 4);
+    });
+    PClip out = gradation(clip, {{"process", "hsv"}, {"curve_type", "linear"},
+                                 {"points", parseArray("[[[0, 0], [255, 255]], [[0, 0], [255, 255]], [[0, 255], [255, 0]]]")},
+                                 {"strength", 0.5}});
+    PVideoFrame frame = out->GetFrame(0, &env);
+    for (int y = 0; y < 8; ++y)
+        for (int x = 0; x < 16; ++x)
+            for (int c = 0; c < 3; ++c)
+                EXPECT_NEAR(rgb32(frame, x, y)[c], 127.5, 1) << "At " << x << ", " << y;
+}
+
+TEST_F(GradationFilterTest, ShouldBlendWithMaskOnRgb32)
+{
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 16, 8, 1, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+            {
+                BYTE *p = rgb32(frame, x, y);
+                p[0] = BYTE(16*x), p[1] = BYTE(32*y), p[2] = BYTE(255 - 16*x), p[3] = 255;
+            }
+    });
+    // The mask is not symmetric vertically, so that it would fail if it was
+    // not flipped to match the bottom-up rows of RGB32.
+    PClip mask = makeClip(VideoInfo::CS_Y8, 16, 8, 1, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+                sample(frame, PLANAR_Y, x, y) = BYTE(x < 4 ? 0 : 32*y + x);
+    });
+    PClip out = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"points", parseArray("[[[0, 255], [255, 0]]]")},
+                                 {"mask", mask}});
+    PVideoFrame src = clip->GetFrame(0, &env), dst = out->GetFrame(0, &env);
+    for (int y = 0; y < 8; ++y)
+        for (int x = 0; x < 16; ++x)
+        {
+            const BYTE *in = rgb32(src, x, y), *p = rgb32(dst, x, y);
+            double weight = (x < 4 ? 0 : 32*y + x)/255.0;
+            for (int c = 0; c < 3; ++c)
+                EXPECT_NEAR(p[c], in[c] + weight*(255 - 2*in[c]), 0.5) << "At " << x << ", " << y;
+        }
+}
+
+TEST_F(GradationFilterTest, ShouldGatherStatsOnRgb32)
+{
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 16, 8, 1, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+            {
+                BYTE *p = rgb32(frame, x, y);
+                p[0] = 255, p[1] = 0, p[2] = BYTE(16*x), p[3] = 255;
+            }
+    });
+    PClip out = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"points", parseArray("[[[0, 255], [255, 0]]]")},
+                                 {"stats", "both"}});
+    PVideoFrame frame = out->GetFrame(0, &env);
+    const AVSMap *props = env.getFramePropsRO(frame);
+    int err = 0;
+    const int64_t *histR = env.propGetIntArray(props, "_GradationInputHistR", &err);
+    ASSERT_EQ(err, 0);
+    ASSERT_EQ(env.propNumElements(props, "_GradationInputHistR"), 256);
+    for (int i = 0; i < 256; ++i)
+        EXPECT_EQ(histR[i], i % 16 == 0 ? 8 : 0) << "In bin " << i;
+    const int64_t *inClippedLow = env.propGetIntArray(props, "_GradationInputClippedLow", &err);
+    EXPECT_EQ(inClippedLow[0], 8);
+    EXPECT_EQ(inClippedLow[1], 128);
+    EXPECT_EQ(inClippedLow[2], 0);
+
+    const double *min = env.propGetFloatArray(props, "_GradationMin", &err);
+    const double *max = env.propGetFloatArray(props, "_GradationMax", &err);
+    ASSERT_EQ(err, 0);
+    EXPECT_EQ(min[0], 15);
+    EXPECT_EQ(max[0], 255);
+    EXPECT_EQ(min[1], 255);
+    EXPECT_EQ(max[1], 255);
+    EXPECT_EQ(min[2], 0);
+    EXPECT_EQ(max[2], 0);
+    const int64_t *clippedHigh = env.propGetIntArray(props, "_GradationClippedHigh", &err);
+    EXPECT_EQ(clippedHigh[0], 8);
+    EXPECT_EQ(clippedHigh[1], 128);
+    EXPECT_EQ(clippedHigh[2], 0);
+}
+
+TEST_F(GradationFilterTest, ShouldChangeOutputBits)
+{
+    PClip clip = makeClip(VideoInfo::CS_RGBP8, 16, 8, 1, [] (int, const PVideoFrame &frame) {
+        for (int plane : {PLANAR_R, PLANAR_G, PLANAR_B})
+            for (int y = 0; y < 8; ++y)
+                for (int x = 0; x < 16; ++x)
+                    sample(frame, plane, x, y) = BYTE(16*x + y);
+    });
+    PClip out = gradation(clip, {{"process", "rgb"}, {"points", parseArray("[[[0, 0], [255, 255]]]")},
+                                 {"precise", true}, {"output_bits", 10}});
+    ASSERT_EQ(out->GetVideoInfo().pixel_type, VideoInfo::CS_RGBP10);
+    PVideoFrame frame = out->GetFrame(0, &env);
+    for (int plane : {PLANAR_R, PLANAR_G, PLANAR_B})
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+            {
+                auto *row = (const uint16_t *) (frame->GetReadPtr(plane) + y*frame->GetPitch(plane));
+                EXPECT_EQ(row[x], int((16*x + y)*1023/255.0 + 0.5)) << "At " << x << ", " << y;
+            }
+
+    EXPECT_THROW(gradation(clip, {{"process", "rgb"}, {"points", parseArray("[[[0, 0], [255, 255]]]")}, {"output_bits", 10}}),
+                 AvisynthError);
+}
+
+TEST_F(GradationFilterTest, ShouldDitherOutput)
+{
+    // 33025/257 = 128.5 is halfway between two 8-bit values.
+    PClip clip = makeClip(VideoInfo::CS_RGBP16, 16, 16, 1, [] (int, const PVideoFrame &frame) {
+        for (int plane : {PLANAR_R, PLANAR_G, PLANAR_B})
+            for (int y = 0; y < 16; ++y)
+                for (int x = 0; x < 16; ++x)
+                    ((uint16_t *) (frame->GetWritePtr(plane) + y*frame->GetPitch(plane)))[x] = 33025;
+    });
+    for (bool dither : {false, true})
+    {
+        PClip out = gradation(clip, {{"process", "rgb"}, {"points", parseArray("[[[0, 0], [255, 255]]]")},
+                                     {"precise", true}, {"output_bits", 8}, {"dither", dither}});
+        ASSERT_EQ(out->GetVideoInfo().pixel_type, VideoInfo::CS_RGBP8);
+        PVideoFrame frame = out->GetFrame(0, &env);
+        int sum = 0, low = 0;
+        for (int y = 0; y < 16; ++y)
+            for (int x = 0; x < 16; ++x)
+            {
+                int v = sample(frame, PLANAR_G, x, y);
+                ASSERT_TRUE(v == 128 || v == 129) << "At " << x << ", " << y;
+                sum += v;
+                low += v == 128;
+            }
+        if (dither)
+            EXPECT_NEAR(sum/256.0, 128.5, 0.05);
+        else
+            EXPECT_EQ(low, 0);
+    }
+}
+
+TEST_F(GradationFilterTest, ShouldNotDitherWithoutLoweringDepth)
+{
+    PClip clip = makeClip(VideoInfo::CS_RGBP8, 16, 16, 1, [] (int, const PVideoFrame &frame) {
+        for (int plane : {PLANAR_R, PLANAR_G, PLANAR_B})
+            for (int y = 0; y < 16; ++y)
+                for (int x = 0; x < 16; ++x)
+                    sample(frame, plane, x, y) = BYTE(16*x + y);
+    });
+    // The curve gives fractional values, which dithering would spread.
+    for (int bits : {8, 10, 16})
+    {
+        PVideoFrame frames[2];
+        for (bool dither : {false, true})
+            frames[dither] = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"points", parseArray("[[[0, 0], [255, 128]]]")},
+                                              {"precise", true}, {"output_bits", bits}, {"dither", dither}})->GetFrame(0, &env);
+        int rowSize = 16*(bits > 8 ? 2 : 1);
+        for (int plane : {PLANAR_R, PLANAR_G, PLANAR_B})
+            for (int y = 0; y < 16; ++y)
+                EXPECT_EQ(memcmp(frames[0]->GetReadPtr(plane) + y*frames[0]->GetPitch(plane),
+                                 frames[1]->GetReadPtr(plane) + y*frames[1]->GetPitch(plane), rowSize), 0)
+                    << "In row " << y << " at " << bits << " bits";
+    }
+}
+
+TEST_F(GradationFilterTest, ShouldInterpolateKeyframes)
+{
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 16, 8, 13, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+                memset(rgb32(frame, x, y), 16*x, 4);
+    });
+    PClip out = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"},
+                                 {"keyframes", parseArray("[[0, [[[0, 0], [255, 255]]]], [10, [[[0, 255], [255, 0]]]]]")}});
+    for (int n : {0, 5, 10, 12})
+    {
+        PVideoFrame frame = out->GetFrame(n, &env);
+        for (int x = 0; x < 16; ++x)
+        {
+            // Halfway, both points are at y = 128 and the curve is flat.
+            int expected = n == 0 ? 16*x : n == 5 ? 128 : 255 - 16*x;
+            EXPECT_NEAR(rgb32(frame, x, 3)[1], expected, 1) << "At " << x << " in frame " << n;
+        }
+    }
+}
+
+TEST_F(GradationFilterTest, ShouldSelectCurvesPerScene)
+{
+    const char *indexFile = "gradation-test-scenes.txt", *curveFile = "gradation-test-scene.amp";
+    writeConstantCurve(curveFile, 200);
+    FILE *file = fopen(indexFile, "w");
+    ASSERT_NE(file, nullptr);
+    fprintf(file, "# Inverted, then constant.\n0 2 points [[[0, 255], [255, 0]]]\n\n5 6 file %s\n", curveFile);
+    fclose(file);
+
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 16, 8, 8, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+                memset(rgb32(frame, x, y), 16*x, 4);
+    });
+    PClip out = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"points", parseArray("[[[0, 0], [255, 255]]]")},
+                                 {"scenes", indexFile}});
+    for (int n = 0; n < 8; ++n)
+    {
+        PVideoFrame frame = out->GetFrame(n, &env);
+        for (int x = 0; x < 16; ++x)
+        {
+            int expected = n <= 2 ? 255 - 16*x : n == 5 || n == 6 ? 200 : 16*x;
+            EXPECT_EQ(rgb32(frame, x, 0)[2], expected) << "At " << x << " in frame " << n;
+        }
+    }
+
+    file = fopen(indexFile, "w");
+    fprintf(file, "0 2 points [[[0, 255], [255, 0]]]\n2 3 points [[[0, 255], [255, 0]]]\n");
+    fclose(file);
+    EXPECT_THROW(gradation(clip, {{"process", "rgb"}, {"scenes", indexFile}}), AvisynthError);
+    remove(indexFile);
+    remove(curveFile);
+}
+
+TEST_F(GradationFilterTest, ShouldReadPointsFromPropsAndVars)
+{
+    auto *source = new TestClip(env, VideoInfo::CS_BGR32, 16, 8, 3);
+    PClip clip = source;
+    for (PVideoFrame &frame : source->frames)
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+                memset(rgb32(frame, x, y), 16*x, 4);
+    const char *inverted = "[[[0, 255], [255, 0]]]";
+    env.propSetData(env.getFramePropsRW(source->frames[1]), "Points", inverted, -1, 0);
+
+    // The property takes precedence over the variable, and the default points
+    // are used when neither is set.
+    PClip out = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"points", parseArray("[[[0, 0], [255, 255]]]")},
+                                 {"points_prop", "Points"}, {"points_var", "points"}});
+    auto expectRed = [&] (int n, const std::function<int (int)> &expected) {
+        PVideoFrame frame = out->GetFrame(n, &env);
+        for (int x = 0; x < 16; ++x)
+            EXPECT_EQ(rgb32(frame, x, 0)[2], expected(x)) << "At " << x << " in frame " << n;
+    };
+    expectRed(0, [] (int x) { return 16*x; });
+    expectRed(1, [] (int x) { return 255 - 16*x; });
+    env.SetVar("points", AVSValue("[[[0, 128], [255, 128]]]"));
+    expectRed(0, [] (int) { return 128; });
+    expectRed(1, [] (int x) { return 255 - 16*x; });
+    env.SetVar("points", parseArray("[[[0, 64], [255, 64]]]"));
+    expectRed(2, [] (int) { return 64; });
+}
+
+TEST_F(GradationFilterTest, ShouldReloadWatchedFile)
+{
+    const char *filename = "gradation-test-watch.amp";
+    writeConstantCurve(filename, 100);
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 16, 8, 1, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+                memset(rgb32(frame, x, y), 16*x, 4);
+    });
+    PClip out = gradation(clip, {{"process", "rgb"}, {"file", filename}, {"watch", true}, {"watch_interval", 5}});
+    auto waitForRed = [&] (int expected) {
+        int red = -1;
+        for (int i = 0; i < 400 && red != expected; ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            red = rgb32(out->GetFrame(0, &env), 3, 0)[2];
+        }
+        EXPECT_EQ(red, expected);
+    };
+    EXPECT_EQ(rgb32(out->GetFrame(0, &env), 3, 0)[2], 100);
+
+    // Rewrites of the same size, well within a second, must all be seen.
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    writeConstantCurve(filename, 150);
+    waitForRed(150);
+    writeConstantCurve(filename, 200);
+    waitForRed(200);
+
+    // A file that cannot be read keeps the previous curves.
+    remove(filename);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    EXPECT_EQ(rgb32(out->GetFrame(0, &env), 3, 0)[2], 200);
+}
+
+#ifndef _WIN32
+TEST_F(GradationFilterTest, ShouldReplaceCurvesThroughControlSocket)
+{
+    const char *path = "gradation-test.sock";
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 16, 8, 1, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 8; ++y)
+            for (int x = 0; x < 16; ++x)
+                memset(rgb32(frame, x, y), 16*x, 4);
+    });
+    PClip out = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"points", parseArray("[[[0, 0], [255, 255]]]")},
+                                 {"control", path}});
+    EXPECT_EQ(rgb32(out->GetFrame(0, &env), 3, 0)[2], 48);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_GE(fd, 0);
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    ASSERT_EQ(connect(fd, (const sockaddr *) &addr, sizeof(addr)), 0);
+    std::string request = "[[[0, 64], [255, 64]]]\n[[[0, 0]\n[[[0, 255], [255, 0]]]\n", replies;
+    ASSERT_EQ(write(fd, request.data(), request.size()), ssize_t(request.size()));
+    char buffer[256];
+    while (std::count(replies.begin(), replies.end(), '\n') < 3)
+    {
+        ssize_t size = read(fd, buffer, sizeof(buffer));
+        ASSERT_GT(size, 0);
+        replies.append(buffer, size);
+    }
+    close(fd);
+
+    // Each line is answered once it has been compiled and published, and an
+    // invalid line does not replace the curves.
+    EXPECT_EQ(replies.substr(0, 3), "OK\n");
+    EXPECT_EQ(replies.substr(3, 6), "ERROR ");
+    EXPECT_EQ(replies.substr(replies.size() - 3), "OK\n");
+    EXPECT_EQ(rgb32(out->GetFrame(0, &env), 3, 0)[2], 255 - 48);
+
+    out = PClip();
+    struct stat st;
+    EXPECT_NE(stat(path, &st), 0);
+}
+#endif
+
+TEST_F(GradationFilterTest, ShouldReuseUnchangedTiles)
+{
+    // 3x2 tiles. Frame 2 differs from the others in a single pixel.
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 130, 70, 6, [] (int n, const PVideoFrame &frame) {
+        for (int y = 0; y < 70; ++y)
+            for (int x = 0; x < 130; ++x)
+                memset(rgb32(frame, x, y), 16*(x % 16), 4);
+        if (n == 2)
+            rgb32(frame, 70, 10)[2] = 0;
+    });
+    env.SetVar("points", AVSValue("[[[0, 0], [255, 255]]]"));
+    PClip out = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"points_var", "points"}, {"dedup", true}});
+
+    // Reused tiles are copied from the previous output, so a marker written
+    // there shows which tiles were processed again.
+    const int marker = 7;
+    auto mark = [&] (const PVideoFrame &frame) {
+        rgb32(frame, 10, 10)[2] = marker;
+        rgb32(frame, 70, 10)[2] = marker;
+    };
+    PVideoFrame frame = out->GetFrame(0, &env);
+    EXPECT_EQ(rgb32(frame, 10, 10)[2], 160);
+    mark(frame);
+    frame = out->GetFrame(1, &env);
+    EXPECT_EQ(rgb32(frame, 10, 10)[2], marker);
+    EXPECT_EQ(rgb32(frame, 70, 10)[2], marker);
+    EXPECT_EQ(rgb32(frame, 71, 10)[2], 112);
+    frame = out->GetFrame(2, &env);
+    EXPECT_EQ(rgb32(frame, 10, 10)[2], marker);
+    EXPECT_EQ(rgb32(frame, 70, 10)[2], 0);
+    EXPECT_EQ(rgb32(frame, 71, 10)[2], 112);
+
+    // New curves invalidate every tile.
+    mark(frame);
+    env.SetVar("points", AVSValue("[[[0, 255], [255, 0]]]"));
+    frame = out->GetFrame(3, &env);
+    EXPECT_EQ(rgb32(frame, 10, 10)[2], 255 - 160);
+    EXPECT_EQ(rgb32(frame, 70, 10)[2], 255 - 96);
+
+    // So does skipping a frame.
+    mark(frame);
+    frame = out->GetFrame(5, &env);
+    EXPECT_EQ(rgb32(frame, 10, 10)[2], 255 - 160);
+    EXPECT_EQ(rgb32(frame, 70, 10)[2], 255 - 96);
+}
+
+TEST_F(GradationFilterTest, ShouldNotReuseTilesAcrossYuvRanges)
+{
+    // Both frames hold the same pixels, but frame 1 is full range.
+    TestClip *source = makeClip(VideoInfo::CS_YV24, 16, 8, 2, [] (int, const PVideoFrame &frame) {
+        for (int plane : {PLANAR_Y, PLANAR_U, PLANAR_V})
+            for (int y = 0; y < 8; ++y)
+                memset(frame->GetWritePtr(plane) + y*frame->GetPitch(plane), plane == PLANAR_Y ? 100 : 128, 16);
+    });
+    PClip clip = source;
+    env.propSetInt(env.getFramePropsRW(source->frames[1]), "_ColorRange", 0, 0);
+    PClip out = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"points", parseArray("[[[0, 255], [255, 0]]]")},
+                                 {"dedup", true}});
+    PVideoFrame frame = out->GetFrame(0, &env);
+    EXPECT_NEAR(sample(frame, PLANAR_Y, 3, 3), 251 - 100, 1);
+    sample(frame, PLANAR_Y, 3, 3) = 7;
+    frame = out->GetFrame(1, &env);
+    EXPECT_NEAR(sample(frame, PLANAR_Y, 3, 3), 255 - 100, 1);
+}
+
+TEST_F(GradationFilterTest, ShouldSampleCurvesOfEachSet)
+{
+    PClip clip = makeClip(VideoInfo::CS_RGBP16, 16, 4, 4, [] (int, const PVideoFrame &frame) {
+        for (int plane : {PLANAR_R, PLANAR_G, PLANAR_B})
+            for (int y = 0; y < 4; ++y)
+                for (int x = 0; x < 16; ++x)
+                    ((uint16_t *) (frame->GetWritePtr(plane) + y*frame->GetPitch(plane)))[x] = uint16_t(4096*x + y);
+    });
+    PClip out = gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"precise", true},
+                                 {"keyframes", parseArray("[[0, [[[0, 0], [255, 255]]]], [1, [[[0, 255], [255, 0]]]], "
+                                                          "[2, [[[0, 0], [255, 255]]]]]")}});
+    for (int n : {0, 1, 2, 3, 1, 0})
+    {
+        PVideoFrame frame = out->GetFrame(n, &env);
+        auto *row = (const uint16_t *) (frame->GetReadPtr(PLANAR_G) + 2*frame->GetPitch(PLANAR_G));
+        for (int x = 0; x < 16; ++x)
+            EXPECT_EQ(row[x], n == 1 ? 65535 - (4096*x + 2) : 4096*x + 2) << "At " << x << " in frame " << n;
+    }
+}
+
+TEST_F(GradationFilterTest, ShouldEvaluateLinearCurvesOnFloat)
+{
+    PClip clip = makeClip(VideoInfo::CS_RGBPS, 16, 2, 2, [] (int, const PVideoFrame &frame) {
+        for (int plane : {PLANAR_R, PLANAR_G, PLANAR_B})
+            for (int y = 0; y < 2; ++y)
+                for (int x = 0; x < 16; ++x)
+                    ((float *) (frame->GetWritePtr(plane) + y*frame->GetPitch(plane)))[x] = x/15.0f;
+    });
+    // Frame 0 has single segments, frame 1 a curve with too many of them.
+    PClip out = gradation(clip, {{"process", "full"}, {"curve_type", "linear"}, {"precise", true},
+                                 {"keyframes", parseArray("[[0, [[[0, 255], [255, 0]], [[0, 0], [64, 64], [128, 128], [192, 192], [255, 255]], [], []]], "
+                                                          "[1, [[[0, 0], [255, 255]], [[0, 0], [64, 128], [128, 64], [192, 200], [255, 255]], [], []]]]")}});
+    PVideoFrame frame = out->GetFrame(0, &env);
+    for (int x = 0; x < 16; ++x)
+    {
+        EXPECT_NEAR(((const float *) frame->GetReadPtr(PLANAR_R))[x], 1 - x/15.0, 1e-5) << "At " << x;
+        EXPECT_NEAR(((const float *) frame->GetReadPtr(PLANAR_G))[x], 1 - x/15.0, 1e-5) << "At " << x;
+    }
+    frame = out->GetFrame(1, &env);
+    EXPECT_NEAR(((const float *) frame->GetReadPtr(PLANAR_R))[15], 1, 1e-5);
+    EXPECT_NEAR(((const float *) frame->GetReadPtr(PLANAR_G))[0], 0, 1e-5);
+}
+
+// Passes frames and cache hints on to its child, and counts the frames it is
+// asked for. If 'isCache', it answers like the cache of AviSynth+.
+class ForwardingClip final : public GenericVideoFilter
+{
+    const bool isCache;
+
+public:
+
+    int requests = 0;
+
+    ForwardingClip(const PClip &child, bool aIsCache) :
+        GenericVideoFilter(child),
+        isCache(aIsCache)
+    {
+    }
+
+    PVideoFrame __stdcall GetFrame(int n, IScriptEnvironment *env) override
+        { ++requests; return child->GetFrame(n, env); }
+    int __stdcall SetCacheHints(int cachehints, int frame_range) override
+    {
+        if (cachehints == CACHE_IS_CACHE_REQ)
+            return isCache ? CACHE_IS_CACHE_ANS : 0;
+        return child->SetCacheHints(cachehints, frame_range);
+    }
+};
+
+TEST_F(GradationFilterTest, ShouldFuseOnlyThroughCaches)
+{
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 16, 2, 1, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 2; ++y)
+            for (int x = 0; x < 16; ++x)
+                memset(rgb32(frame, x, y), 16*x, 4);
+    });
+    AVSValue inverted = parseArray("[[[0, 255], [255, 0]]]");
+    for (bool isCache : {true, false})
+    {
+        auto *between = new ForwardingClip(gradation(clip, {{"process", "rgb"}, {"curve_type", "linear"}, {"points", inverted}}), isCache);
+        PClip inner = between;
+        PClip out = gradation(inner, {{"process", "rgb"}, {"curve_type", "linear"}, {"points", inverted}});
+        PVideoFrame frame = out->GetFrame(0, &env);
+        for (int x = 0; x < 16; ++x)
+            EXPECT_EQ(rgb32(frame, x, 0)[2], 16*x) << "At " << x;
+        EXPECT_EQ(between->requests, isCache ? 0 : 1);
+    }
+
+    // Modes other than 'rgb' and 'full' are not combined.
+    auto *between = new ForwardingClip(gradation(clip, {{"process", "hsv"}, {"points", parseArray("[[], [], [[0, 0], [255, 128]]]")}}), true);
+    PClip inner = between;
+    gradation(inner, {{"process", "hsv"}, {"points", parseArray("[[], [], [[0, 0], [128, 255]]]")}})->GetFrame(0, &env);
+    EXPECT_EQ(between->requests, 1);
+}
+
+TEST_F(GradationFilterTest, ShouldSetCacheProps)
+{
+    // Two colours in vertical stripes: the first pixel of each row misses,
+    // the second one hits, and the rest repeat the pixel before them.
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 16, 4, 1, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 4; ++y)
+            for (int x = 0; x < 16; ++x)
+                memset(rgb32(frame, x, y), x < 8 ? 50 : 200, 4);
+    });
+    PClip out = gradation(clip, {{"process", "hsv"}, {"points", parseArray("[[], [], [[0, 0], [255, 128]]]")}, {"cache", true}});
+    PVideoFrame frame = out->GetFrame(0, &env);
+    const AVSMap *props = env.getFramePropsRO(frame);
+    int err = 0;
+    int64_t hits = env.propGetInt(props, "_GradationCacheHits", 0, &err);
+    int64_t runs = env.propGetInt(props, "_GradationCacheRuns", 0, &err);
+    double rate = env.propGetFloat(props, "_GradationCacheHitRate", 0, &err);
+    ASSERT_EQ(err, 0);
+    EXPECT_GT(runs, 0);
+    EXPECT_LT(hits + runs, 64);
+    EXPECT_DOUBLE_EQ(rate, (hits + runs)/64.0);
+    EXPECT_EQ(rgb32(frame, 0, 0)[2], 25);
+}
+
+TEST_F(GradationFilterTest, ShouldKeepCacheBetweenFrames)
+{
+    PClip clip = makeClip(VideoInfo::CS_BGR32, 16, 4, 3, [] (int, const PVideoFrame &frame) {
+        for (int y = 0; y < 4; ++y)
+            for (int x = 0; x < 16; ++x)
+                memset(rgb32(frame, x, y), x < 8 ? 50 : 200, 4);
+    });
+    env.SetVar("points", AVSValue("[[], [], [[0, 0], [255, 128]]]"));
+    PClip out = gradation(clip, {{"process", "hsv"}, {"points_var", "points"}, {"cache", true}});
+    auto hits = [&] (const PVideoFrame &frame) {
+        int err = 0;
+        return env.propGetInt(env.getFramePropsRO(frame), "_GradationCacheHits", 0, &err);
+    };
+    PVideoFrame frame = out->GetFrame(0, &env);
+    EXPECT_LT(hits(frame), 8);
+
+    // Both colours were cached by the previous frame.
+    frame = out->GetFrame(1, &env);
+    EXPECT_EQ(hits(frame), 8);
+    EXPECT_EQ(rgb32(frame, 0, 0)[2], 25);
+
+    // New curves empty the cache.
+    env.SetVar("points", AVSValue("[[], [], [[0, 0], [255, 255]]]"));
+    frame = out->GetFrame(2, &env);
+    EXPECT_LT(hits(frame), 8);
+    EXPECT_EQ(rgb32(frame, 0, 0)[2], 50);
+}
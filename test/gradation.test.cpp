@@ -1,5 +1,8 @@
 #include "test.h"
 
+#include <algorithm>
+#include <vector>
+
 #include "gradation.h"
 
 std::ostream &operator<<(std::ostream &os, const RGB<uint8_t> &input)
@@ -147,3 +150,590 @@ TEST(Gradation, ShouldProcessFullInt)
         expectMatchingResult(actual, testCase);
     }
 }
+
+TEST(Gradation, ShouldProcessWeighted)
+{
+    static constexpr Curve curves[] =
+    {
+        {CHANNEL_RGB, 2, {{0, 0}, {252, 63}}}, // y = x/4.
+    };
+    static constexpr TestCase<RGB<double>> testCases[] =
+    {
+        {{0, 0, 0}, {0, 0, 0}},
+        {{4, 4, 4}, {1, 1, 1}},
+        {{8, 4, 0}, {4.4375, 0.4375, 0}}, // Average 4.75, moved by -3.5625.
+    };
+
+    for (auto mode : {PROCMODE_RGBW, PROCMODE_FULLW})
+        for (auto &testCase : testCases)
+        {
+            Gradation grd;
+            Init(grd, true);
+            grd.process = mode;
+            for (auto &curve : curves)
+                ImportPoints(grd, curve.channel, curve.points, curve.count, curve.drawMode);
+            auto &in = testCase.input;
+            auto actual = mode == PROCMODE_RGBW ? procModeRgbw::processDouble(grd, in.r, in.g, in.b)
+                                                : procModeFullw::processDouble(grd, in.r, in.g, in.b);
+            expectMatchingResult(actual, testCase);
+        }
+}
+
+TEST(Gradation, ShouldProcessWeightedLikeInt)
+{
+    static const uint8_t points[][2] = {{0, 20}, {120, 90}, {255, 230}};
+    static const uint8_t redPoints[][2] = {{0, 0}, {60, 120}, {255, 200}};
+    Gradation grd;
+    Init(grd, true);
+    ImportPoints(grd, CHANNEL_RGB, points, 3, DRAWMODE_SPLINE);
+    ImportPoints(grd, CHANNEL_RED, redPoints, 3, DRAWMODE_SPLINE);
+    // The integer version truncates the weighted average.
+    for (int r = 0; r < 256; r += 5)
+        for (int g = 0; g < 256; g += 3)
+            for (int b = 0; b < 256; b += 7)
+            {
+                auto expected = procModeRgbw::processInt(grd, r, g, b);
+                auto actual = procModeRgbw::processDouble(grd, r, g, b);
+                ASSERT_NEAR(actual.r, expected.r, 1.5) << r << ", " << g << ", " << b;
+                ASSERT_NEAR(actual.g, expected.g, 1.5) << r << ", " << g << ", " << b;
+                ASSERT_NEAR(actual.b, expected.b, 1.5) << r << ", " << g << ", " << b;
+                expected = procModeFullw::processInt(grd, r, g, b);
+                actual = procModeFullw::processDouble(grd, r, g, b);
+                ASSERT_NEAR(actual.r, expected.r, 2.0) << r << ", " << g << ", " << b;
+                ASSERT_NEAR(actual.g, expected.g, 2.0) << r << ", " << g << ", " << b;
+                ASSERT_NEAR(actual.b, expected.b, 2.0) << r << ", " << g << ", " << b;
+            }
+}
+
+TEST(Gradation, ShouldProcessCmyk)
+{
+    static constexpr Curve curves[] =
+    {
+        {CHANNEL_BLACK, 2, {{0, 0}, {254, 127}}}, // y = x/2.
+    };
+    static constexpr TestCase<RGB<double>> testCases[] =
+    {
+        {{0, 0, 0}, {128, 128, 128}},
+        {{255, 255, 255}, {255, 255, 255}},
+        {{200, 100, 50}, {227.5, 113.75, 56.875}},
+    };
+
+    for (auto &testCase : testCases)
+    {
+        Gradation grd;
+        Init(grd, true);
+        for (auto &curve : curves)
+            ImportPoints(grd, curve.channel, curve.points, curve.count, curve.drawMode);
+        auto &in = testCase.input;
+        auto actual = procModeCmyk::processDouble(grd, in.r, in.g, in.b);
+        expectMatchingResult(actual, testCase);
+    }
+}
+
+TEST(Gradation, ShouldProcessCmykLikeInt)
+{
+    static const uint8_t points[][2] = {{0, 20}, {120, 90}, {255, 230}};
+    Gradation grd;
+    Init(grd, true);
+    for (int c = 1; c < 5; ++c)
+        ImportPoints(grd, Channel(c), points, 3, DRAWMODE_SPLINE);
+    // The integer version rounds at every step, and quantizes C, M and Y
+    // coarsely for very dark colours.
+    for (int r = 32; r < 256; r += 7)
+        for (int g = 0; g < 256; g += 5)
+            for (int b = 0; b < 256; b += 3)
+            {
+                auto expected = procModeCmyk::processInt(grd, r, g, b);
+                auto actual = procModeCmyk::processDouble(grd, r, g, b);
+                ASSERT_NEAR(actual.r, expected.r, 2.0) << r << ", " << g << ", " << b;
+                ASSERT_NEAR(actual.g, expected.g, 2.0) << r << ", " << g << ", " << b;
+                ASSERT_NEAR(actual.b, expected.b, 2.0) << r << ", " << g << ", " << b;
+            }
+}
+
+TEST(Gradation, ShouldProcessLab)
+{
+    Gradation grd;
+    Init(grd, true);
+    grd.process = PROCMODE_LAB;
+    PreCalcLut(grd); // Not needed with precise, and should not fill the tables.
+    EXPECT_EQ(rgblab[0xFFFFFF], 0);
+    for (int r = 0; r < 256; r += 15)
+        for (int g = 0; g < 256; g += 15)
+            for (int b = 0; b < 256; b += 15)
+            {
+                auto actual = procModeLab::processDouble(grd, r, g, b);
+                ASSERT_NEAR(actual.r, r, 0.25) << r << ", " << g << ", " << b;
+                ASSERT_NEAR(actual.g, g, 0.25) << r << ", " << g << ", " << b;
+                ASSERT_NEAR(actual.b, b, 0.25) << r << ", " << g << ", " << b;
+            }
+
+    static const uint8_t points[][2] = {{0, 0}, {255, 127}}; // Halves L.
+    ImportPoints(grd, CHANNEL_L, points, 2, DRAWMODE_LINEAR);
+    auto gray = procModeLab::processDouble(grd, 255, 255, 255);
+    EXPECT_NEAR(gray.r, gray.g, 0.25);
+    EXPECT_NEAR(gray.b, gray.g, 0.25);
+    EXPECT_NEAR(gray.g, 118.42, 0.01); // sRGB value of L = 49.8.
+}
+
+TEST(Gradation, ShouldProcessFloatLikeDouble)
+{
+    static const uint8_t points[][2] = {{0, 20}, {120, 90}, {255, 230}};
+    static const uint8_t huePoints[][2] = {{0, 40}, {100, 60}, {200, 250}, {255, 40}};
+    std::vector<float> r, g, b;
+    for (int i = 0; i < 6; ++i)
+        for (int j = 0; j < 50; ++j)
+            for (int k = 0; k < 50; ++k)
+            {
+                float v[3] = {255.0f - i*0.3f, j*5.2f, k*5.2f}; // Every hue sector and grays.
+                r.push_back(v[i % 3]);
+                g.push_back(v[(i + 1 + i/3) % 3]);
+                b.push_back(v[(i + 2 - i/3) % 3]);
+            }
+
+    for (ProcessingMode mode : {PROCMODE_YUV, PROCMODE_HSV})
+    {
+        Gradation grd;
+        Init(grd, true);
+        grd.process = mode;
+        ImportPoints(grd, CHANNEL_HUE, huePoints, 4, DRAWMODE_SPLINE);
+        ImportPoints(grd, CHANNEL_SATURATION, points, 3, DRAWMODE_LINEAR);
+        ImportPoints(grd, CHANNEL_VALUE, points, 3, DRAWMODE_SPLINE);
+        std::vector<float> rf = r, gf = g, bf = b;
+        if (mode == PROCMODE_YUV)
+            procModeYuv::processFloat(grd, rf.data(), gf.data(), bf.data(), rf.size());
+        else
+            procModeHsv::processFloat(grd, rf.data(), gf.data(), bf.data(), rf.size());
+        for (size_t i = 0; i < r.size(); ++i)
+        {
+            auto expected = mode == PROCMODE_YUV ? procModeYuv::processDouble(grd, r[i], g[i], b[i])
+                                                 : procModeHsv::processDouble(grd, r[i], g[i], b[i]);
+            ASSERT_NEAR(rf[i], expected.r, 0.001) << "Mode " << mode << " at " << r[i] << ", " << g[i] << ", " << b[i];
+            ASSERT_NEAR(gf[i], expected.g, 0.001) << "Mode " << mode << " at " << r[i] << ", " << g[i] << ", " << b[i];
+            ASSERT_NEAR(bf[i], expected.b, 0.001) << "Mode " << mode << " at " << r[i] << ", " << g[i] << ", " << b[i];
+        }
+    }
+}
+
+TEST(Gradation, ShouldComposeCurves)
+{
+    static constexpr Curve firstCurves[] =
+    {
+        {CHANNEL_RGB, 3, {{0, 10}, {128, 100}, {255, 240}}, DRAWMODE_SPLINE},
+    };
+    static constexpr Curve secondCurves[] =
+    {
+        {CHANNEL_RGB, 2, {{0, 0}, {252, 63}}}, // y = x/4.
+        {CHANNEL_RED, 2, {{0, 0}, {254, 127}}}, // y = x/2.
+        {CHANNEL_BLUE, 2, {{0, 0}, {127, 254}}}, // y = x*2.
+    };
+
+    Gradation first, second;
+    Init(first, false);
+    Init(second, false);
+    first.process = PROCMODE_RGB;
+    second.process = PROCMODE_FULL;
+    for (auto &curve : firstCurves)
+        ImportPoints(first, curve.channel, curve.points, curve.count, curve.drawMode);
+    for (auto &curve : secondCurves)
+        ImportPoints(second, curve.channel, curve.points, curve.count, curve.drawMode);
+
+    Gradation composed = second;
+    ASSERT_TRUE(ComposeCurves(composed, first));
+
+    for (int v = 0; v < 256; v += 5)
+    {
+        RGB<uint8_t> in {uint8_t(v), uint8_t(255 - v), uint8_t(v/2)};
+        auto med = procModeRgb::processInt(first, in.r, in.g, in.b);
+        auto expected = procModeFull::processInt(second, med.r, med.g, med.b);
+        EXPECT_EQ(procModeFull::processInt(composed, in.r, in.g, in.b), expected);
+
+        auto medf = procModeRgb::processDouble(first, in.r, in.g, in.b);
+        auto expectedf = procModeFull::processDouble(second, medf.r, medf.g, medf.b);
+        auto actualf = procModeFull::processDouble(composed, in.r, in.g, in.b);
+        EXPECT_DOUBLE_EQ(actualf.r, expectedf.r);
+        EXPECT_DOUBLE_EQ(actualf.g, expectedf.g);
+        EXPECT_DOUBLE_EQ(actualf.b, expectedf.b);
+    }
+}
+
+TEST(Gradation, ShouldOnlyComposeRgbModes)
+{
+    Gradation first, second;
+    Init(first, false);
+    Init(second, false);
+    first.process = PROCMODE_RGBW;
+    second.process = PROCMODE_RGB;
+    EXPECT_FALSE(ComposeCurves(second, first));
+    first.process = PROCMODE_HSV;
+    EXPECT_FALSE(ComposeCurves(second, first));
+    // The colour-space modes clamp between both steps, so they are not
+    // combined with themselves either.
+    for (ProcessingMode process : {PROCMODE_YUV, PROCMODE_CMYK, PROCMODE_HSV, PROCMODE_LAB, PROCMODE_RGBW})
+    {
+        first.process = second.process = process;
+        EXPECT_FALSE(ComposeCurves(second, first));
+    }
+}
+
+TEST(Gradation, ShouldApplyLevels)
+{
+    static constexpr TestCase<RGB<uint8_t>> testCases[] =
+    {
+        {{0, 16, 235}, {16, 30, 218}},
+        {{255, 126, 20}, {235, 124, 33}},
+    };
+    static constexpr TestCase<RGB<double>> testCasesLimited[] =
+    {
+        {{0, 16, 235}, {0, 0, 255}},
+        {{255, 125.5, 20}, {255, 127.5, 4*255.0/219}},
+    };
+
+    for (auto &testCase : testCases)
+    {
+        // Full to limited range.
+        Gradation grd;
+        Init(grd, false);
+        ASSERT_TRUE(ApplyLevels(grd, {0, 255, 1}, {16, 235, 1}));
+        auto &in = testCase.input;
+        expectMatchingResult(procModeFull::processInt(grd, in.r, in.g, in.b), testCase);
+    }
+    for (auto &testCase : testCasesLimited)
+    {
+        // Limited to full range.
+        Gradation grd;
+        Init(grd, true);
+        ASSERT_TRUE(ApplyLevels(grd, {16, 235, 1}, {0, 255, 1}));
+        auto &in = testCase.input;
+        auto actual = procModeFull::processDouble(grd, in.r, in.g, in.b);
+        EXPECT_NEAR(actual.r, testCase.result.r, 1e-9);
+        EXPECT_NEAR(actual.g, testCase.result.g, 1e-9);
+        EXPECT_NEAR(actual.b, testCase.result.b, 1e-9);
+    }
+
+    Gradation grd;
+    Init(grd, false);
+    grd.process = PROCMODE_HSV;
+    EXPECT_FALSE(ApplyLevels(grd, {16, 235, 1}, {0, 255, 1}));
+}
+
+TEST(Gradation, ShouldApplyStrength)
+{
+    static constexpr Curve curves[] =
+    {
+        {CHANNEL_RGB, 2, {{0, 0}, {252, 63}}}, // y = x/4.
+        {CHANNEL_GREEN, 2, {{0, 0}, {127, 254}}}, // y = x*2.
+    };
+    static constexpr TestCase<RGB<double>> testCases[] =
+    {
+        {{0, 0, 0}, {0, 0, 0}},
+        {{8, 8, 8}, {5, 6, 5}},
+        {{40, 20, 100}, {25, 15, 62.5}},
+    };
+
+    for (auto &testCase : testCases)
+    {
+        Gradation grd;
+        Init(grd, true);
+        grd.process = PROCMODE_FULL;
+        for (auto &curve : curves)
+            ImportPoints(grd, curve.channel, curve.points, curve.count, curve.drawMode);
+        ASSERT_TRUE(ApplyStrength(grd, 0.5));
+        auto &in = testCase.input;
+        auto actual = procModeFull::processDouble(grd, in.r, in.g, in.b);
+        expectMatchingResult(actual, testCase);
+    }
+}
+
+TEST(Gradation, ShouldMakeAutoPoints)
+{
+    double histogram[256] {0};
+    histogram[20] = 1;
+    histogram[40] = 49;
+    histogram[100] = 49;
+    histogram[200] = 1;
+    uint8_t points[maxPoints][2];
+
+    ASSERT_EQ(MakeAutoPoints(histogram, AUTOCURVE_LEVELS, 0, 1, points), 2u);
+    EXPECT_EQ(points[0][0], 20); EXPECT_EQ(points[0][1], 0);
+    EXPECT_EQ(points[1][0], 200); EXPECT_EQ(points[1][1], 255);
+
+    ASSERT_EQ(MakeAutoPoints(histogram, AUTOCURVE_STRETCH, 0.01, 1, points), 2u);
+    EXPECT_EQ(points[0][0], 40);
+    EXPECT_EQ(points[1][0], 100);
+
+    size_t count = MakeAutoPoints(histogram, AUTOCURVE_EQUALIZE, 0, 1, points);
+    ASSERT_EQ(count, 17u);
+    EXPECT_EQ(points[0][0], 0); EXPECT_EQ(points[0][1], 0);
+    EXPECT_EQ(points[2][0], 32); EXPECT_EQ(points[2][1], 3); // 1 pixel below.
+    EXPECT_EQ(points[16][0], 255); EXPECT_EQ(points[16][1], 255);
+    for (size_t i = 1; i < count; ++i)
+        EXPECT_LE(points[i - 1][1], points[i][1]);
+
+    ASSERT_EQ(MakeAutoPoints(histogram, AUTOCURVE_EQUALIZE, 0, 0, points), 17u);
+    EXPECT_EQ(points[2][1], 32);
+}
+
+TEST(Gradation, ShouldRoundTripCompiledCurves)
+{
+    static constexpr Curve curve {CHANNEL_RGB, 3, {{0, 0}, {128, 160}, {255, 255}}};
+    const char *filename = "gradation-test.grdc";
+
+    Gradation grd;
+    Init(grd, true);
+    grd.process = PROCMODE_RGB;
+    ImportPoints(grd, curve.channel, curve.points, curve.count, curve.drawMode);
+    ASSERT_TRUE(ApplyStrength(grd, 0.5));
+    ASSERT_TRUE(ExportCurve(grd, filename, FILETYPE_GRDC));
+
+    Gradation loaded;
+    Init(loaded, true);
+    loaded.process = PROCMODE_RGB;
+    ASSERT_TRUE(ImportCurve(loaded, filename, FILETYPE_GRDC));
+    EXPECT_EQ(loaded.process, grd.process);
+    for (int c = 0; c < 5; ++c)
+        for (int x = 0; x < 256; ++x)
+        {
+            EXPECT_EQ(loaded.ovalue(c, x), grd.ovalue(c, x));
+            EXPECT_EQ(loaded.ovaluef(c, x), grd.ovaluef(c, x));
+        }
+
+    Gradation other;
+    Init(other, false);
+    other.process = PROCMODE_HSV;
+    EXPECT_FALSE(ImportCurve(other, filename, FILETYPE_GRDC));
+
+    // The layout does not depend on the build: a 24-byte header, then the
+    // fields of Gradation without padding.
+    FILE *file = fopen(filename, "r+b");
+    ASSERT_NE(file, nullptr);
+    fseek(file, 0, SEEK_END);
+    EXPECT_EQ(ftell(file), 24 + 4*7*256 + 5*256 + 8*5*256 + 4 + 4*5 + 5*maxPoints*2 + 4*5 + 10);
+    uint8_t header[8];
+    fseek(file, 0, SEEK_SET);
+    ASSERT_EQ(fread(header, 1, 8, file), 8u);
+    EXPECT_EQ(memcmp(header, "GRDC\x02\0\0\0", 8), 0);
+
+    // Corrupt one byte of the tables.
+    fseek(file, -1000, SEEK_END);
+    int c = fgetc(file);
+    fseek(file, -1000, SEEK_END);
+    fputc(c ^ 1, file);
+    fclose(file);
+    EXPECT_FALSE(ImportCurve(loaded, filename, FILETYPE_GRDC));
+    remove(filename);
+}
+
+TEST(Gradation, ShouldRejectInvalidCompiledCurves)
+{
+    static constexpr Curve curve {CHANNEL_RGB, 3, {{0, 0}, {128, 160}, {255, 255}}};
+    const char *filename = "gradation-test-invalid.grdc";
+    // Offsets in the file: the checksum in the header, then the points and
+    // their counts after the tables, the processing mode and the draw modes.
+    const size_t checksumOffset = 16, payloadOffset = 24;
+    const size_t pointsOffset = payloadOffset + 4*7*256 + 5*256 + 8*5*256 + 4 + 4*5;
+    const size_t countsOffset = pointsOffset + 5*maxPoints*2;
+
+    Gradation grd;
+    Init(grd, false);
+    grd.process = PROCMODE_RGB;
+    ImportPoints(grd, curve.channel, curve.points, curve.count, curve.drawMode);
+    ASSERT_TRUE(ExportCurve(grd, filename, FILETYPE_GRDC));
+    std::vector<uint8_t> data;
+    FILE *file = fopen(filename, "rb");
+    ASSERT_NE(file, nullptr);
+    for (int c; (c = fgetc(file)) != EOF; )
+        data.push_back(uint8_t(c));
+    fclose(file);
+    remove(filename);
+
+    // Rewrites the checksum, so that only the validation of the fields can
+    // reject the file.
+    auto load = [&] (std::vector<uint8_t> bytes) {
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = payloadOffset; i < bytes.size(); ++i)
+            hash = (hash ^ bytes[i])*1099511628211ull;
+        for (int i = 0; i < 8; ++i)
+            bytes[checksumOffset + i] = uint8_t(hash >> 8*i);
+        Gradation loaded;
+        Init(loaded, false);
+        loaded.process = PROCMODE_RGB;
+        return ImportCurveFromMemory(loaded, bytes.data(), bytes.size(), FILETYPE_GRDC);
+    };
+    ASSERT_TRUE(load(data));
+
+    std::vector<uint8_t> truncated(data.begin(), data.end() - 1);
+    EXPECT_FALSE(load(truncated));
+
+    for (uint8_t count : {0, 1})
+    {
+        std::vector<uint8_t> few = data;
+        few[countsOffset + 4*CHANNEL_RGB] = count;
+        EXPECT_FALSE(load(few)) << "With " << int(count) << " points";
+    }
+
+    std::vector<uint8_t> unordered = data;
+    unordered[pointsOffset + 2*maxPoints*CHANNEL_RGB + 2] = 0; // x of the second point.
+    EXPECT_FALSE(load(unordered));
+
+    std::vector<uint8_t> gamma = data;
+    gamma[payloadOffset + 4*7*256 + 5*256 + 8*5*256 + 4 + 4*CHANNEL_RED] = DRAWMODE_GAMMA;
+    EXPECT_FALSE(load(gamma)); // With the 2 points of a reset channel.
+}
+
+TEST(Gradation, ShouldImportCurveFromMemory)
+{
+    uint8_t amp[256];
+    for (int i = 0; i < 256; ++i)
+        amp[i] = uint8_t(255 - i);
+    Gradation grd;
+    Init(grd);
+    ASSERT_TRUE(ImportCurveFromMemory(grd, amp, sizeof(amp), FILETYPE_AMP));
+    EXPECT_EQ(grd.ovalue(CHANNEL_RGB, 0), 255);
+    EXPECT_EQ(grd.ovalue(CHANNEL_RGB, 200), 55);
+    EXPECT_EQ(grd.rvalue[0][10], 245 << 16);
+
+    static const uint8_t acv[] = {0, 4, 0, 1, 0, 2, 0, 0, 0, 0, 0, 255, 0, 255};
+    Init(grd);
+    ASSERT_TRUE(ImportCurveFromMemory(grd, acv, sizeof(acv), FILETYPE_ACV, DRAWMODE_LINEAR));
+    EXPECT_EQ(grd.poic[CHANNEL_RGB], 2);
+    EXPECT_EQ(grd.ovalue(CHANNEL_RGB, 0), 0);
+    EXPECT_EQ(grd.ovalue(CHANNEL_RGB, 100), 100);
+}
+
+TEST(Gradation, ShouldCalculateCurveRange)
+{
+    static const uint8_t points[][2] = {{10, 20}, {60, 40}, {128, 128}, {200, 180}, {240, 250}};
+    Gradation grd, full;
+    Init(grd);
+    ImportPoints(grd, CHANNEL_RED, points, 5, DRAWMODE_LINEAR);
+    for (int cp = 0; cp < 5; ++cp)
+    {
+        grd.drwpoint[CHANNEL_RED][cp][0] += 3;
+        grd.drwpoint[CHANNEL_RED][cp][1] -= 7;
+        CalcCurve(grd, CHANNEL_RED, cp, cp);
+        full = grd;
+        CalcCurve(full, CHANNEL_RED);
+        EXPECT_EQ(memcmp(&grd, &full, sizeof(grd)), 0) << "After moving point " << cp;
+    }
+
+    static const uint8_t line[][2] = {{0, 10}, {50, 60}, {100, 110}, {200, 210}};
+    ImportPoints(grd, CHANNEL_RGB, line, 4, DRAWMODE_SPLINE);
+    for (int i = 0; i < 256; ++i)
+        EXPECT_NEAR(grd.ovaluef(CHANNEL_RGB, i), std::min(i, 200) + 10, 1e-9) << "At " << i;
+}
+
+TEST(Gradation, ShouldCalculateCurveSamples)
+{
+    static const uint8_t line[][2] = {{0, 0}, {252, 63}}; // y = x/4.
+    static const uint8_t spline[][2] = {{0, 0}, {64, 90}, {192, 200}, {255, 255}};
+    static const uint8_t gamma[][2] = {{0, 0}, {128, 64}, {255, 255}};
+    Gradation grd;
+    Init(grd);
+    ImportPoints(grd, CHANNEL_RED, line, 2, DRAWMODE_LINEAR);
+    ImportPoints(grd, CHANNEL_GREEN, spline, 4, DRAWMODE_SPLINE);
+    ImportPoints(grd, CHANNEL_BLUE, gamma, 3, DRAWMODE_GAMMA);
+
+    std::vector<float> samples(1024);
+    CalcCurveSamples(grd, CHANNEL_RED, samples.size(), samples.data());
+    EXPECT_FLOAT_EQ(samples[1], 255.0/1023/4);
+    EXPECT_FLOAT_EQ(samples[1000], 255.0*1000/1023/4);
+    EXPECT_FLOAT_EQ(samples[1023], 63);
+
+    std::vector<float> exact(256);
+    for (Channel c : {CHANNEL_GREEN, CHANNEL_BLUE})
+    {
+        CalcCurveSamples(grd, c, exact.size(), exact.data());
+        for (int x = 0; x < 256; ++x)
+            EXPECT_NEAR(exact[x], grd.ovaluef(c, x), 1e-4) << "Channel " << c << " at " << x;
+    }
+
+    grd.process = PROCMODE_FULL;
+    ImportPoints(grd, CHANNEL_RGB, line, 2, DRAWMODE_LINEAR);
+    CalcRgbSamples(grd, CHANNEL_BLUE, samples.size(), samples.data());
+    std::vector<float> blue(samples.size());
+    CalcCurveSamples(grd, CHANNEL_BLUE, blue.size(), blue.data());
+    for (size_t i = 0; i < samples.size(); i += 31)
+        EXPECT_NEAR(samples[i], std::min(blue[i], 252.0f)/4, 1e-4) << "At " << i;
+}
+
+TEST(Gradation, ShouldGetLinearSegments)
+{
+    static const uint8_t three[][2] = {{16, 0}, {64, 100}, {200, 180}, {235, 255}};
+    static const uint8_t four[][2] = {{0, 0}, {64, 100}, {128, 128}, {200, 180}, {255, 255}};
+    Gradation grd;
+    Init(grd);
+    LinearSegments segments;
+    ASSERT_TRUE(GetLinearSegments(grd, CHANNEL_RGB, segments));
+    EXPECT_EQ(segments.count, 0);
+
+    ImportPoints(grd, CHANNEL_RGB, four, 5, DRAWMODE_LINEAR);
+    EXPECT_FALSE(GetLinearSegments(grd, CHANNEL_RGB, segments));
+    ImportPoints(grd, CHANNEL_RGB, three, 4, DRAWMODE_SPLINE);
+    EXPECT_FALSE(GetLinearSegments(grd, CHANNEL_RGB, segments));
+    ImportPoints(grd, CHANNEL_RGB, three, 4, DRAWMODE_LINEAR);
+    ASSERT_TRUE(GetLinearSegments(grd, CHANNEL_RGB, segments));
+    ASSERT_EQ(segments.count, 3);
+    for (double x = 0; x <= 255; x += 0.25)
+    {
+        double y = segments.y0;
+        for (int i = 0; i < segments.count; ++i)
+            y += segments.slope[i]*(std::min(std::max(x, segments.x[i]), segments.x[i + 1]) - segments.x[i]);
+        EXPECT_NEAR(y, procModeRgb::processDouble(grd, x, x, x).r, 1e-9) << "At " << x;
+    }
+}
+
+TEST(Gradation, ShouldCachePixelResults)
+{
+    static const uint8_t points[][2] = {{0, 20}, {120, 90}, {255, 230}};
+    uint32_t src[64], plain[64], cached[64];
+    for (int i = 0; i < 64; ++i)
+        src[i] = (i/4 % 3)*0x204060U + (i % 2)*0x010101U + (uint32_t(i) << 24);
+
+    for (ProcessingMode mode : {PROCMODE_YUV, PROCMODE_HSV, PROCMODE_CMYK})
+    {
+        Gradation grd;
+        Init(grd);
+        grd.process = mode;
+        for (int c = 1; c < 5; ++c)
+            ImportPoints(grd, Channel(c), points, 3, DRAWMODE_SPLINE);
+        PixelCache cache;
+        ::Run(grd, 16, 4, src, plain, 16*4, 16*4);
+        ::Run(grd, 16, 4, src, cached, 16*4, 16*4, &cache);
+        EXPECT_EQ(memcmp(plain, cached, sizeof(plain)), 0) << "Mode " << mode;
+        EXPECT_EQ(cache.pixels, 64u);
+        EXPECT_EQ(cache.runs, 0u);
+        EXPECT_EQ(cache.hits, 64u - 6u); // 3 colours, with 2 variants each.
+    }
+}
+
+TEST(Gradation, ShouldProcessGrayPixelsAndFlatRowsLikeOthers)
+{
+    static const uint8_t points[][2] = {{0, 20}, {120, 90}, {255, 230}};
+    uint32_t src[4][16], dst[4][16];
+    for (int i = 0; i < 16; ++i)
+    {
+        src[0][i] = 0x000000U | (uint32_t(i) << 24); // Black row.
+        src[1][i] = 0xFFFFFFU;                       // White row.
+        src[2][i] = (i*17)*0x010101U;                // Gray ramp.
+        src[3][i] = (i % 2 ? (i*17)*0x010101U : 0x204060U*(i % 4/2 + 1)) | 0x80000000U;
+    }
+
+    for (ProcessingMode mode : {PROCMODE_YUV, PROCMODE_HSV, PROCMODE_CMYK})
+        for (bool precise : {false, true})
+        {
+            Gradation grd;
+            Init(grd, precise);
+            grd.process = mode;
+            for (int c = 1; c < 5; ++c)
+                ImportPoints(grd, Channel(c), points, 3, DRAWMODE_SPLINE);
+            ::Run(grd, 16, 4, src[0], dst[0], 16*4, 16*4);
+            for (int y = 0; y < 4; ++y)
+                for (int x = 0; x < 16; ++x)
+                {
+                    uint32_t single;
+                    ::Run(grd, 1, 1, &src[y][x], &single, 4, 4);
+                    ASSERT_EQ(dst[y][x], single) << "Mode " << mode << ", precise " << precise << " at " << x << ", " << y;
+                }
+        }
+}
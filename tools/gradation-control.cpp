@@ -0,0 +1,101 @@
+// Sends point sets to the control socket of a Gradation filter (see the
+// 'control' argument) and prints the replies.
+//
+// Usage: gradation-control <socket> [<points>...]
+//
+// Each <points> argument is sent as one line, e.g. "[[[0, 0], [128, 150], [255, 255]]]".
+// Without <points>, lines are read from the standard input instead. Exits with
+// status 1 if any point set is rejected.
+
+#include <string>
+#include <iostream>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static bool sendLine(int fd, std::string line)
+{
+    line.push_back('\n');
+    for (size_t sent = 0; sent < line.size(); )
+    {
+        ssize_t size = write(fd, line.data() + sent, line.size() - sent);
+        if (size < 0 && errno != EINTR)
+            return false;
+        sent += size > 0 ? size : 0;
+    }
+    return true;
+}
+
+static bool receiveLine(int fd, std::string &line)
+{
+    line.clear();
+    char c;
+    ssize_t size;
+    while ((size = read(fd, &c, 1)) != 0)
+    {
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size < 0)
+            return false;
+        if (c == '\n')
+            return true;
+        line.push_back(c);
+    }
+    return false;
+}
+
+static bool sendPoints(int fd, const std::string &points, bool &accepted)
+{
+    std::string reply;
+    if (!sendLine(fd, points) || !receiveLine(fd, reply))
+        return false;
+    puts(reply.c_str());
+    accepted = accepted && reply == "OK";
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <socket> [<points>...]\n", argv[0]);
+        return 2;
+    }
+
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long: %s\n", argv[1]);
+        return 2;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (const sockaddr *) &addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "Cannot connect to '%s': %s\n", argv[1], strerror(errno));
+        return 2;
+    }
+
+    bool accepted = true, connected = true;
+    if (argc > 2)
+        for (int i = 2; connected && i < argc; ++i)
+            connected = sendPoints(fd, argv[i], accepted);
+    else
+    {
+        std::string line;
+        while (connected && std::getline(std::cin, line))
+            connected = sendPoints(fd, line, accepted);
+    }
+    close(fd);
+
+    if (!connected)
+    {
+        fprintf(stderr, "Connection to '%s' lost\n", argv[1]);
+        return 2;
+    }
+    return accepted ? 0 : 1;
+}